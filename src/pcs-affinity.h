@@ -0,0 +1,242 @@
+/*
+ * pcs-affinity.h
+ *
+ * CPU placement of the hot threads. Every thread has a role (capture,
+ * compute, sender, receiver, render); -A <role>=<cpus>[:<priority>]
+ * pins the role to a CPU list and optionally runs it SCHED_FIFO at the
+ * given priority.
+ *
+ * Threads that take a slot (OpenMP workers, per camera receivers) get one
+ * CPU of the list each, so a role can be spread over isolcpus cores, which
+ * the scheduler never balances on its own. Threads without a slot may run
+ * on any CPU of the list. Threads started by a pinned thread, such as the
+ * librealsense USB threads started with the pipeline, inherit its role.
+ * A thread pinned to a role without CPUs or a priority of its own goes back
+ * to the CPUs the process started with and to SCHED_OTHER, so it never
+ * keeps the placement of the thread that created it.
+ *
+ * Pinned threads register their CPU clock, so the CPU time of each role
+ * can be reported as a share of one core.
+ */
+
+#ifndef PCS_AFFINITY_H
+#define PCS_AFFINITY_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <pthread.h>
+#include <omp.h>
+
+#include <chrono>
+#include <mutex>
+#include <string>
+#include <vector>
+#include <fstream>
+#include <iostream>
+#include <algorithm>
+
+enum threadRole { ROLE_CAPTURE, ROLE_COMPUTE, ROLE_SENDER, ROLE_RECEIVER, ROLE_RENDER, ROLE_COUNT };
+
+struct roleConfig {
+    std::vector<int> cpus;      // Empty for the CPUs the process started with
+    int fifo_priority = 0;      // 0 for SCHED_OTHER
+};
+
+struct roleUsage {
+    std::vector<clockid_t> clocks;  // CPU clocks of the live threads
+    double retired = 0;             // CPU seconds of threads that exited
+    double last_total = 0;
+};
+
+struct roleState {
+    roleConfig config[ROLE_COUNT];
+    roleUsage usage[ROLE_COUNT];
+    cpu_set_t initial_cpus;     // Affinity of the process before any pinning
+    std::mutex mutex;
+    std::chrono::steady_clock::time_point last_report = std::chrono::steady_clock::now();
+
+    roleState()
+    {
+        if (sched_getaffinity(0, sizeof(initial_cpus), &initial_cpus)) {
+            CPU_ZERO(&initial_cpus);
+            for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) CPU_SET(cpu, &initial_cpus);
+        }
+    }
+};
+
+inline roleState &roles()
+{
+    static roleState state;
+    return state;
+}
+
+inline const char *roleName(int role)
+{
+    static const char *names[ROLE_COUNT] = {"capture", "compute", "sender", "receiver", "render"};
+    return names[role];
+}
+
+// Parses a CPU list such as "0,2-4".
+inline bool parseCpuList(const std::string &list, std::vector<int> &cpus)
+{
+    const char *p = list.c_str();
+    while (*p) {
+        char *end;
+        long first = strtol(p, &end, 10), last = first;
+        if (end == p || first < 0 || first >= CPU_SETSIZE) return false;
+        if (*end == '-') {
+            p = end + 1;
+            last = strtol(p, &end, 10);
+            if (end == p || last < first || last >= CPU_SETSIZE) return false;
+        }
+        for (long cpu = first; cpu <= last; cpu++) cpus.push_back(cpu);
+        if (*end == ',') end++;
+        else if (*end) return false;
+        p = end;
+    }
+    return !cpus.empty();
+}
+
+// Parses one -A argument, <role>=<cpus>[:<fifo priority>].
+inline bool parseAffinity(const char *arg)
+{
+    std::string spec(arg);
+    size_t eq = spec.find('=');
+    if (eq == std::string::npos) return false;
+
+    int role = 0;
+    while (role < ROLE_COUNT && spec.compare(0, eq, roleName(role))) role++;
+    if (role == ROLE_COUNT) return false;
+
+    std::string cpus = spec.substr(eq + 1);
+    roleConfig &config = roles().config[role];
+    size_t colon = cpus.find(':');
+    if (colon != std::string::npos) {
+        config.fifo_priority = atoi(cpus.c_str() + colon + 1);
+        cpus.resize(colon);
+    }
+
+    config.cpus.clear();
+    return parseCpuList(cpus, config.cpus);
+}
+
+// CPUs removed from the scheduler with isolcpus.
+inline std::vector<int> isolatedCpus()
+{
+    std::vector<int> cpus;
+    std::string list;
+    std::ifstream file("/sys/devices/system/cpu/isolated");
+    if (std::getline(file, list) && !list.empty()) parseCpuList(list, cpus);
+    return cpus;
+}
+
+inline void printAffinity()
+{
+    std::vector<int> isolated = isolatedCpus();
+
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        const roleConfig &config = roles().config[role];
+        if (config.cpus.empty() && !config.fifo_priority) continue;
+
+        std::cout << "Role " << roleName(role) << ": CPUs";
+        for (int cpu : config.cpus) {
+            std::cout << " " << cpu;
+            if (std::find(isolated.begin(), isolated.end(), cpu) != isolated.end()) std::cout << "(isolated)";
+        }
+        if (config.fifo_priority) std::cout << ", SCHED_FIFO " << config.fifo_priority;
+        std::cout << std::endl;
+    }
+}
+
+// Applies the role's placement to the calling thread and starts accounting
+// its CPU time. A slot of -1 allows the whole CPU list, otherwise the thread
+// is pinned to one CPU of it. The placement and policy inherited from the
+// creating thread are replaced either way.
+inline void pinThread(int role, int slot = -1)
+{
+    roleState &state = roles();
+    const roleConfig &config = state.config[role];
+
+    cpu_set_t set = state.initial_cpus;
+    if (!config.cpus.empty()) {
+        CPU_ZERO(&set);
+        if (slot >= 0) CPU_SET(config.cpus[slot % config.cpus.size()], &set);
+        else for (int cpu : config.cpus) CPU_SET(cpu, &set);
+    }
+    int err = pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    if (err) std::cerr << "Pinning " << roleName(role) << " thread failed: " << strerror(err) << std::endl;
+
+    struct sched_param param;
+    param.sched_priority = config.fifo_priority;
+    err = pthread_setschedparam(pthread_self(), config.fifo_priority ? SCHED_FIFO : SCHED_OTHER, &param);
+    if (err) std::cerr << (config.fifo_priority ? "SCHED_FIFO" : "SCHED_OTHER") << " for " << roleName(role)
+                       << " failed: " << strerror(err) << std::endl;
+
+    clockid_t clock;
+    if (pthread_getcpuclockid(pthread_self(), &clock) == 0) {
+        std::lock_guard<std::mutex> lock(state.mutex);
+        state.usage[role].clocks.push_back(clock);
+    }
+}
+
+// Stops accounting the calling thread, keeping the CPU time it used. Call
+// before a pinned thread exits.
+inline void releaseThread(int role)
+{
+    roleState &state = roles();
+    clockid_t clock;
+    struct timespec ts;
+    if (pthread_getcpuclockid(pthread_self(), &clock) || clock_gettime(clock, &ts)) return;
+
+    std::lock_guard<std::mutex> lock(state.mutex);
+    std::vector<clockid_t> &clocks = state.usage[role].clocks;
+    auto it = std::find(clocks.begin(), clocks.end(), clock);
+    if (it == clocks.end()) return;
+
+    clocks.erase(it);
+    state.usage[role].retired += ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+// Pins the workers of an OpenMP team of the given size, one CPU each.
+// Thread 0 is the caller, which keeps its own role.
+inline void pinComputeTeam(int threads)
+{
+    #pragma omp parallel num_threads(threads)
+    {
+        if (omp_get_thread_num() > 0)
+            pinThread(ROLE_COMPUTE, omp_get_thread_num() - 1);
+    }
+}
+
+// Prints the CPU time each role used since the last report, as a percentage
+// of one core.
+inline void printRoleUsage()
+{
+    roleState &state = roles();
+    std::lock_guard<std::mutex> lock(state.mutex);
+
+    auto now = std::chrono::steady_clock::now();
+    double wall = std::chrono::duration<double>(now - state.last_report).count();
+    state.last_report = now;
+    if (wall <= 0) return;
+
+    std::cout << "CPU:";
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        roleUsage &usage = state.usage[role];
+        if (usage.clocks.empty() && usage.retired == 0) continue;
+
+        double total = usage.retired;
+        for (clockid_t clock : usage.clocks) {
+            struct timespec ts;
+            if (clock_gettime(clock, &ts) == 0) total += ts.tv_sec + ts.tv_nsec * 1e-9;
+        }
+        std::cout << " " << roleName(role) << " " << int(100 * (total - usage.last_total) / wall) << "%";
+        usage.last_total = total;
+    }
+    std::cout << std::endl;
+}
+
+#endif
@@ -0,0 +1,120 @@
+/*
+ * pcs-arena.h
+ *
+ * Arena for the large frame buffers. The whole region is mapped once,
+ * backed by 2 MB huge pages when the kernel has a pool (MAP_HUGETLB) or
+ * transparent huge pages otherwise, optionally placed on one NUMA node
+ * and locked in RAM. Every page is touched when the arena is created, so
+ * the per-frame path neither faults nor walks 4 KB page tables.
+ *
+ * threadPageFaults() and processPageFaults() read the kernel's fault
+ * counters, to check that the hot path really stays fault free.
+ */
+
+#ifndef PCS_ARENA_H
+#define PCS_ARENA_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#define ARENA_ALIGN         64
+#define ARENA_HUGE_PAGE     (2 << 20)
+
+#ifndef MPOL_PREFERRED
+#define MPOL_PREFERRED      1
+#endif
+
+struct frameArena {
+    char *base = NULL;
+    size_t size = 0;
+    size_t used = 0;
+    bool hugetlb = false;   // Explicit huge pages, otherwise THP was requested
+    bool locked = false;
+    int node = -1;          // Preferred NUMA node, -1 for the default policy
+};
+
+struct pageFaults {
+    long minor;
+    long major;
+};
+
+// Maps and pre-faults an arena of at least the given size. A node of -1
+// keeps the default (first touch) placement.
+inline bool arenaCreate(frameArena *arena, size_t bytes, int node, bool lock)
+{
+    size_t len = (bytes + ARENA_HUGE_PAGE - 1) & ~(size_t)(ARENA_HUGE_PAGE - 1);
+
+    void *base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    arena->hugetlb = base != MAP_FAILED;
+    if (!arena->hugetlb) {
+        base = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (base == MAP_FAILED) return false;
+        madvise(base, len, MADV_HUGEPAGE);
+    }
+
+    // The policy has to be set before the pages are first touched
+    if (node >= 0 && node < 64) {
+        unsigned long mask = 1UL << node;
+        if (syscall(SYS_mbind, base, len, MPOL_PREFERRED, &mask, sizeof(mask) * 8, 0) != 0)
+            perror("mbind failed, using default placement");
+    }
+
+    memset(base, 0, len);
+
+    arena->locked = lock && mlock(base, len) == 0;
+    if (lock && !arena->locked) perror("mlock failed");
+
+    arena->base = (char *)base;
+    arena->size = len;
+    arena->used = 0;
+    arena->node = node;
+    return true;
+}
+
+// Hands out a cache line aligned block, or NULL if the arena is exhausted.
+inline void *arenaAlloc(frameArena *arena, size_t bytes)
+{
+    size_t offset = (arena->used + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    if (offset + bytes > arena->size) return NULL;
+
+    arena->used = offset + bytes;
+    return arena->base + offset;
+}
+
+inline void arenaDestroy(frameArena *arena)
+{
+    if (!arena->base) return;
+    if (arena->locked) munlock(arena->base, arena->size);
+    munmap(arena->base, arena->size);
+    arena->base = NULL;
+    arena->size = arena->used = 0;
+}
+
+inline const char *arenaPageType(const frameArena *arena)
+{
+    return arena->hugetlb ? "huge pages" : "THP";
+}
+
+// Page faults taken by the calling thread so far.
+inline pageFaults threadPageFaults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_THREAD, &usage);
+    return {usage.ru_minflt, usage.ru_majflt};
+}
+
+// Page faults taken by the whole process, including OpenMP workers.
+inline pageFaults processPageFaults()
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return {usage.ru_minflt, usage.ru_majflt};
+}
+
+#endif
@@ -0,0 +1,267 @@
+/*
+ * pcs-calibrate.cpp
+ *
+ * Computes the camera-to-world transforms of the rig from surveyed marker
+ * coordinates and writes a calibration file that pcs-camera-optimized and
+ * pcs-multicamera-optimized load with -k.
+ *
+ * Each camera has a center marker <L> and four plate markers <L>1..<L>4
+ * (L = A, B, C, ...), arranged around the camera like this:
+ *
+ *     1-----2
+ *     ---C---
+ *     4-----3
+ *
+ * with the camera X axis pointing from 2 to 1 and Y from 1 to 4. Every
+ * camera pose is the least-squares rigid fit (Kabsch) of the plate model
+ * onto its five markers. All cameras share the same plate, so a joint
+ * refinement alternates between the plate size common to all cameras and
+ * the per-camera poses until the total residual stops improving.
+ *
+ * Input is the marker CSV: pointNo,X,Y,Z,Label (no header).
+ */
+
+#include <Eigen/Dense>
+
+#include <getopt.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <cmath>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+const int NUM_MARKERS = 5;          // Center + 4 plate markers
+const int MAX_ITERATIONS = 50;
+
+struct cameraMarkers {
+    std::string label;
+    Eigen::Vector3d markers[NUM_MARKERS];   // Center, 1, 2, 3, 4
+    Eigen::Matrix4d pose;
+    double rms;
+};
+
+char *input_file = NULL;
+char *output_file = (char *)"calibration.txt";
+
+void print_usage() {
+    printf("\nUsage: pcs-calibrate -i <markers.csv> [-o <calibration.txt>]\n\n");
+}
+
+// Parse arguments for extra runtime options
+void parseArgs(int argc, char** argv) {
+    int c;
+    while ((c = getopt(argc, argv, "hi:o:")) != -1) {
+        switch(c) {
+            case 'i':
+                input_file = optarg;
+                break;
+            case 'o':
+                output_file = optarg;
+                break;
+            default:
+            case 'h':
+                print_usage();
+                exit(0);
+        }
+    }
+
+    if (input_file == NULL) {
+        print_usage();
+        exit(EXIT_FAILURE);
+    }
+}
+
+// Parses one coordinate field; false unless the whole field is a number.
+bool parseCoordinate(const std::string &field, double &value) {
+    const char *start = field.c_str();
+    char *end;
+    value = strtod(start, &end);
+    if (end == start) return false;
+    while (isspace((unsigned char)*end)) end++;
+    return *end == '\0' && std::isfinite(value);
+}
+
+// Reads the marker CSV and groups the markers by camera label. Rows without
+// a label or with a coordinate that isn't a number, such as the header, are
+// skipped.
+std::vector<cameraMarkers> readMarkers(const char *filename) {
+    std::ifstream file(filename);
+    if (!file) {
+        std::cerr << "Couldn't open " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::map<std::string, std::map<int, Eigen::Vector3d>> labeled;
+    std::string line;
+    while (std::getline(file, line)) {
+        std::istringstream row(line);
+        std::string field[5];
+        for (int k = 0; k < 5; k++) std::getline(row, field[k], ',');
+        if (field[4].empty()) continue;
+
+        std::string label = field[4];
+        while (!label.empty() && isspace((unsigned char)label.back())) label.pop_back();
+        if (label.empty()) continue;
+
+        // "A" is the center marker (index 0), "A1".."A4" the plate markers
+        int marker = 0;
+        if (isdigit((unsigned char)label.back())) {
+            marker = label.back() - '0';
+            label.pop_back();
+        }
+        if (label.empty() || marker >= NUM_MARKERS) continue;
+
+        Eigen::Vector3d position;
+        if (!parseCoordinate(field[1], position.x()) || !parseCoordinate(field[2], position.y()) ||
+            !parseCoordinate(field[3], position.z())) continue;
+        labeled[label][marker] = position;
+    }
+
+    std::vector<cameraMarkers> cameras;
+    for (auto &entry : labeled) {
+        if (entry.second.size() != NUM_MARKERS) {
+            std::cerr << "Camera " << entry.first << " has " << entry.second.size() << " of " << NUM_MARKERS << " markers, skipped" << std::endl;
+            continue;
+        }
+
+        cameraMarkers camera;
+        camera.label = entry.first;
+        for (int k = 0; k < NUM_MARKERS; k++) camera.markers[k] = entry.second[k];
+        cameras.push_back(camera);
+    }
+
+    return cameras;
+}
+
+// Marker positions in the camera frame for a plate of half width a and
+// half height b.
+void plateModel(double a, double b, Eigen::Vector3d model[NUM_MARKERS]) {
+    model[0] = Eigen::Vector3d(0, 0, 0);
+    model[1] = Eigen::Vector3d( a, -b, 0);
+    model[2] = Eigen::Vector3d(-a, -b, 0);
+    model[3] = Eigen::Vector3d(-a,  b, 0);
+    model[4] = Eigen::Vector3d( a,  b, 0);
+}
+
+// Least-squares rigid transform mapping the model onto the measured markers
+// (Kabsch). Returns the RMS residual.
+double fitPose(const Eigen::Vector3d model[NUM_MARKERS], cameraMarkers &camera) {
+    Eigen::Vector3d model_mean = Eigen::Vector3d::Zero(), meas_mean = Eigen::Vector3d::Zero();
+    for (int k = 0; k < NUM_MARKERS; k++) {
+        model_mean += model[k];
+        meas_mean += camera.markers[k];
+    }
+    model_mean /= NUM_MARKERS;
+    meas_mean /= NUM_MARKERS;
+
+    Eigen::Matrix3d cov = Eigen::Matrix3d::Zero();
+    for (int k = 0; k < NUM_MARKERS; k++)
+        cov += (camera.markers[k] - meas_mean) * (model[k] - model_mean).transpose();
+
+    Eigen::JacobiSVD<Eigen::Matrix3d> svd(cov, Eigen::ComputeFullU | Eigen::ComputeFullV);
+    Eigen::Matrix3d d = Eigen::Matrix3d::Identity();
+    d(2, 2) = (svd.matrixU() * svd.matrixV().transpose()).determinant() < 0 ? -1 : 1;
+    Eigen::Matrix3d rotation = svd.matrixU() * d * svd.matrixV().transpose();
+
+    camera.pose = Eigen::Matrix4d::Identity();
+    camera.pose.topLeftCorner<3, 3>() = rotation;
+    camera.pose.topRightCorner<3, 1>() = meas_mean - rotation * model_mean;
+
+    double error = 0;
+    for (int k = 0; k < NUM_MARKERS; k++)
+        error += (camera.pose.topLeftCorner<3, 3>() * model[k] + camera.pose.topRightCorner<3, 1>() - camera.markers[k]).squaredNorm();
+    camera.rms = std::sqrt(error / NUM_MARKERS);
+    return error;
+}
+
+// Best plate size for fixed poses: the residual is linear in a and b, so
+// each is the mean projection of the measured markers onto its axis.
+void fitPlate(const std::vector<cameraMarkers> &cameras, double *a, double *b) {
+    const int sign_x[NUM_MARKERS] = {0, 1, -1, -1, 1};
+    const int sign_y[NUM_MARKERS] = {0, -1, -1, 1, 1};
+    double sum_a = 0, sum_b = 0;
+
+    for (const auto &camera : cameras) {
+        Eigen::Matrix3d rotation = camera.pose.topLeftCorner<3, 3>();
+        Eigen::Vector3d center = camera.pose.topRightCorner<3, 1>();
+        for (int k = 1; k < NUM_MARKERS; k++) {
+            Eigen::Vector3d local = rotation.transpose() * (camera.markers[k] - center);
+            sum_a += sign_x[k] * local.x();
+            sum_b += sign_y[k] * local.y();
+        }
+    }
+
+    *a = sum_a / (4 * cameras.size());
+    *b = sum_b / (4 * cameras.size());
+}
+
+void writeCalibration(const char *filename, const std::vector<cameraMarkers> &cameras, double a, double b) {
+    std::ofstream file(filename);
+    if (!file) {
+        std::cerr << "Couldn't write " << filename << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    file << "# Generated by pcs-calibrate from " << input_file << std::endl;
+    file << "# Plate half size: " << a << " x " << b << " m" << std::endl;
+    file << std::fixed << std::setprecision(8);
+    for (size_t i = 0; i < cameras.size(); i++) {
+        file << "camera " << i << " " << cameras[i].label << " " << cameras[i].rms << std::endl;
+        for (int r = 0; r < 4; r++) {
+            for (int c = 0; c < 4; c++)
+                file << (c ? " " : "") << cameras[i].pose(r, c);
+            file << std::endl;
+        }
+    }
+}
+
+int main(int argc, char** argv) {
+    parseArgs(argc, argv);
+
+    std::vector<cameraMarkers> cameras = readMarkers(input_file);
+    if (cameras.empty()) {
+        std::cerr << "No complete camera marker sets in " << input_file << std::endl;
+        return EXIT_FAILURE;
+    }
+
+    // Initial plate size from the marker spacing
+    double a = 0, b = 0;
+    for (const auto &camera : cameras) {
+        const Eigen::Vector3d *m = camera.markers;
+        a += ((m[1] - m[2]).norm() + (m[4] - m[3]).norm()) / 4;
+        b += ((m[4] - m[1]).norm() + (m[3] - m[2]).norm()) / 4;
+    }
+    a /= cameras.size();
+    b /= cameras.size();
+
+    // Joint refinement: poses for the current plate, then the plate for the current poses
+    Eigen::Vector3d model[NUM_MARKERS];
+    double error = 0, last_error = INFINITY;
+    int iter;
+    for (iter = 0; iter < MAX_ITERATIONS; iter++) {
+        plateModel(a, b, model);
+        error = 0;
+        for (auto &camera : cameras) error += fitPose(model, camera);
+
+        if (last_error - error < 1e-12) break;
+        last_error = error;
+        fitPlate(cameras, &a, &b);
+    }
+
+    std::cout << "Solved " << cameras.size() << " cameras in " << iter + 1 << " iterations" << std::endl;
+    std::cout << "Plate half size: " << a << " x " << b << " m" << std::endl;
+    std::cout << std::fixed << std::setprecision(3);
+    for (size_t i = 0; i < cameras.size(); i++)
+        std::cout << "camera " << i << " (" << cameras[i].label << "): RMS " << cameras[i].rms * 1000 << " mm" << std::endl;
+    std::cout << "Total RMS: " << std::sqrt(error / (NUM_MARKERS * cameras.size())) * 1000 << " mm" << std::endl;
+
+    writeCalibration(output_file, cameras, a, b);
+    std::cout << "Wrote " << output_file << std::endl;
+    return 0;
+}
@@ -0,0 +1,47 @@
+/*
+ * pcs-calibration.h
+ *
+ * Reader for the calibration files written by pcs-calibrate. A file holds
+ * one camera-to-world transform per camera:
+ *
+ *   camera <index> <label> <rms>
+ *   r00 r01 r02 x
+ *   r10 r11 r12 y
+ *   r20 r21 r22 z
+ *   0   0   0   1
+ *
+ * Lines starting with '#' are comments.
+ */
+
+#ifndef PCS_CALIBRATION_H
+#define PCS_CALIBRATION_H
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+// Reads the row-major 4x4 transform of the given camera into mat.
+// Returns false if the file cannot be read or has no such camera.
+inline bool loadCalibration(const std::string &path, int camera, float mat[16]) {
+    std::ifstream file(path);
+    if (!file) return false;
+
+    std::string line;
+    while (std::getline(file, line)) {
+        if (line.empty() || line[0] == '#') continue;
+
+        std::istringstream header(line);
+        std::string tag, label;
+        int index;
+        if (!(header >> tag >> index >> label) || tag != "camera" || index != camera) continue;
+
+        for (int k = 0; k < 16; k++) {
+            if (!(file >> mat[k])) return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+#endif
@@ -15,8 +15,11 @@
 
 #include <iostream>
 
+#include "pcs-profiles.h"
+
 char *filename = "samples.bag";
 int n_frames = 30;
+const captureProfile *capture_profile = findCaptureProfile("record");
 
 // Exit gracefully by closing all open sockets and freeing buffer
 void sigintHandler(int dummy) {
@@ -25,13 +28,16 @@ void sigintHandler(int dummy) {
 }
 
 void print_usage() {
-    printf("\nUsage: pcs-camera-grab-frames -f <samples.bag> -n <#frames>\n\n");
+    printf("\nUsage: pcs-camera-grab-frames -f <samples.bag> -n <#frames> -p <profile>\n\n");
+    printf("Capture profiles (default record):\n");
+    printCaptureProfiles();
+    printf("\n");
 }
 
 // Parse arguments for extra runtime options
 void parseArgs(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "hf:n:")) != -1) {
+    while ((c = getopt(argc, argv, "hf:n:p:")) != -1) {
         switch(c) {
             case 'h':
                 print_usage();
@@ -42,6 +48,12 @@ void parseArgs(int argc, char** argv) {
             case 'n':
                 n_frames = atoi(optarg);
                 break;
+            case 'p':
+                if ((capture_profile = findCaptureProfile(optarg)) == NULL) {
+                    print_usage();
+                    exit(EXIT_FAILURE);
+                }
+                break;
         }
     }
 
@@ -66,8 +78,7 @@ int main (int argc, char** argv) {
     //cfg.enable_stream(RS2_STREAM_INFRARED, 1, 640, 480, RS2_FORMAT_Y8, 30);
     //cfg.enable_stream(RS2_STREAM_INFRARED, 2, 640, 480, RS2_FORMAT_Y8, 30);
 
-    cfg.enable_stream(RS2_STREAM_COLOR, 1920, 1080, RS2_FORMAT_RGB8, 30);
-    cfg.enable_stream(RS2_STREAM_DEPTH, 1280, 720, RS2_FORMAT_Z16, 30);
+    enableCaptureProfile(cfg, capture_profile);
 
     cfg.enable_record_to_file(filename);
     
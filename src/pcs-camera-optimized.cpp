@@ -8,56 +8,125 @@
 #include <chrono>
 
 #include <string>
+#include <vector>
+#include <memory>
+#include <algorithm>
 #include <unistd.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <getopt.h>
 #include <signal.h>
 
+#include <errno.h>
+#include <poll.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <sys/ioctl.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <linux/sockios.h>
+#include <arpa/inet.h>
+#include <linux/errqueue.h>
 
 #include <librealsense2/rs.hpp>
+#include <librealsense2/rsutil.h>
 
-#include <omp.h>
-#include <immintrin.h>
-#include <xmmintrin.h>
+#include "pcs-udp.h"
+#include "pcs-shm.h"
+#include "pcs-calibration.h"
+#include "pcs-profiles.h"
+#include "pcs-protocol.h"
+#include "pcs-arena.h"
+#include "pcs-affinity.h"
+#include "pcs-edge.h"
 
 #define TIME_NOW    std::chrono::high_resolution_clock::now()
-#define BUF_SIZE    5000000
 #define CONV_RATE   1000.0
 #define DOWNSAMPLE  1
 #define PORT        8000
 
-struct point {
-    
-    // Coordenates
-    short x;
-    short y;
-    short z;
-
-    // Colors
-    char r;
-    char g;
-    char b; 
-};
+#define QUALITY_LATENCY_MS  100     // Default latency budget of the quality controller
+#define QUALITY_HOLD        15      // Frames to wait after a change before judging it
+#define QUALITY_RECOVER     60      // Frames with headroom before quality is raised again
+
+#define BG_REFRESH          30      // Default frames between background refreshes
+
+// A frame buffer starts with a slot for the frame header, so the header and
+// the payload go out as one contiguous block that outlives the send
+#define FRAME_HEADER_SHORTS (sizeof(frameHeader) / sizeof(short))
+
+#ifndef SO_ZEROCOPY
+#define SO_ZEROCOPY 60
+#endif
+#ifndef MSG_ZEROCOPY
+#define MSG_ZEROCOPY 0x4000000
+#endif
+#ifndef SO_EE_ORIGIN_ZEROCOPY
+#define SO_EE_ORIGIN_ZEROCOPY 5
+#endif
+#ifndef SO_EE_CODE_ZEROCOPY_COPIED
+#define SO_EE_CODE_ZEROCOPY_COPIED 1
+#endif
 
 typedef std::chrono::high_resolution_clock clockTime;
 typedef std::chrono::duration<double, std::milli> timeMilli;
 typedef std::chrono::time_point<clockTime> timestamp;
 
 char *filename;
+char *calibration_file = NULL;
+const captureProfile *capture_profile = NULL;
+int frame_capacity = 0;                 // Points per frame of the largest depth stream
+streamHeader stream_header;             // Announced to the central computer on connect
+frameArena frame_arena;                 // Frame buffer and LUT planes
+rayLUT ray_lut;                         // Built on the first frame with -l
+backgroundModel background;             // Of the single camera, with -g
+bool lock_memory = false;
+int camera_index = 0;
+bool all_devices = false;               // Drive every connected camera (-D)
+int num_cameras = 1;
 
 bool display_updates = false;
 bool send_buffer = false;
 bool cutoff = false;
-bool use_simd = false;
+bool transform = false;
+colorMode color_mode = COLOR_GATHER;
+int bench_frames = 0;                   // Frames per case of the color benchmark (-b)
+int replay_passes = 0;                  // Passes of the recording benchmark (-B)
+bool preload = false;                   // Load the recording into memory first (-R)
 bool compress = false;
+bool use_lut = false;
+bool use_zerocopy = false;
+int bg_learn = 0;                       // Frames the background is learned over, 0 to send it (-g)
+int bg_refresh = BG_REFRESH;            // Frames between background refreshes
 int num_of_threads = 1;
 int client_sock = 0;
 int sockfd = 0;
 
-short *thread_buffers[16];
+// UDP transport (-u)
+char *udp_address = NULL;
+int udp_port = PORT;
+int udp_mtu = UDP_MTU;
+float udp_loss = 0;
+int udp_sock = 0;
+uint32_t udp_frame_id = 0;
+
+// Shared-memory transport (-S)
+char *shm_name = NULL;
+shmHandle shm_handle;
+
+// Adaptive quality (-Q). Each level of the ladder keeps fewer points: every
+// stride-th point, and at the last levels only points within max_range.
+struct qualityLevel {
+    int stride;
+    float max_range;        // Meters from the camera, 0 for no crop
+};
+
+const qualityLevel QUALITY_LADDER[] = {{1, 0}, {2, 0}, {3, 0}, {4, 0}, {4, 4.0}, {6, 3.0}};
+const int QUALITY_LEVELS = sizeof(QUALITY_LADDER) / sizeof(QUALITY_LADDER[0]);
+
+float quality_fps = 0;                  // Target frame rate, 0 disables the controller
+float quality_latency = QUALITY_LATENCY_MS;
+int quality_level = 0;
 
 timestamp time_start, time_end;
 
@@ -65,52 +134,310 @@ float tf_mat[] =   {-0.99977970,  0.00926272,  0.01883480,  0.00000000,
                     -0.01638983,  0.21604544, -0.97624574,  3.41600000,
                     -0.01311186, -0.97633937, -0.21584603,  1.80200000,
                      0.00000000,  0.00000000,  0.00000000,  1.00000000};
-                 
-__m128 ss_a = _mm_set_ps(0, tf_mat[8], tf_mat[4], tf_mat[0]);
-__m128 ss_b = _mm_set_ps(0, tf_mat[9], tf_mat[5], tf_mat[1]);
-__m128 ss_c = _mm_set_ps(0, tf_mat[10], tf_mat[6], tf_mat[2]);
-__m128 ss_d = _mm_set_ps(0, tf_mat[11], tf_mat[7], tf_mat[3]);
 
-// Creates TCP stream socket and connects to the central computer.
+void initZeroCopy(int sock);
+
+// Accepts the central computer's connection and sends it the stream handshake.
 void initSocket(int port) {
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;
-    serv_addr.sin_port = htons(port);
-    
-    auto sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    client_sock = acceptCentral(port, stream_header, &sockfd);
+    if (use_zerocopy) initZeroCopy(client_sock);
+}
 
-    // reuse SOCKET AND ADDRESS/PORT
+// Transmit statistics, accumulated by sendFrame
+struct txStats {
+    long frames = 0;
+    long bytes = 0;
+    long syscalls = 0;
+    long zc_copied = 0;     // MSG_ZEROCOPY sends the kernel fell back to copying
+    timestamp window_start = TIME_NOW;
+    long window_bytes = 0;
+    long window_frames = 0;
+    long window_syscalls = 0;
+    pageFaults window_faults = processPageFaults();
+};
+
+txStats tx_stats;
+
+// MSG_ZEROCOPY completion tracking. Every zerocopy sendmsg gets the next
+// sequence number; the kernel reports finished ranges on the error queue.
+unsigned int zc_issued = 0;
+unsigned int zc_completed = 0;
+
+// Enables MSG_ZEROCOPY on the connected socket, falling back to regular sends
+// if the kernel does not support it.
+void initZeroCopy(int sock) {
     int opt = 1;
-    if(setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR , &opt, sizeof(opt))) perror("setsockopt failed");
+    if (setsockopt(sock, SOL_SOCKET, SO_ZEROCOPY, &opt, sizeof(opt))) {
+        perror("SO_ZEROCOPY not supported, using copying sends");
+        use_zerocopy = false;
+    }
+}
 
-    if (sockfd < 0) {
-        std::cerr << "\nSocket fd not received." << std::endl;
+// Drains MSG_ZEROCOPY notifications from the socket error queue. If blocking,
+// waits until every issued send has completed, so the buffer can be reused.
+void reapZeroCopy(int sock, bool blocking) {
+    while (zc_completed != zc_issued) {
+        char control[128];
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+
+        if (recvmsg(sock, &msg, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN || !blocking) return;
+
+            struct pollfd pfd = {sock, 0, 0};    // POLLERR is always reported
+            poll(&pfd, 1, 100);
+            continue;
+        }
+
+        for (struct cmsghdr *cm = CMSG_FIRSTHDR(&msg); cm; cm = CMSG_NXTHDR(&msg, cm)) {
+            auto *serr = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cm));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) continue;
+
+            // [ee_info, ee_data] is the inclusive range of completed sends
+            zc_completed = serr->ee_data + 1;
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED)
+                tx_stats.zc_copied += serr->ee_data - serr->ee_info + 1;
+        }
+    }
+}
+
+// Writes the whole iovec with sendmsg, advancing past partial writes and
+// retrying interrupted or would-block sends. Returns false if the peer is gone.
+bool sendAll(int sock, struct iovec *iov, int iovcnt) {
+    int flags = MSG_NOSIGNAL | (use_zerocopy ? MSG_ZEROCOPY : 0);
+
+    while (iovcnt > 0) {
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = iovcnt;
+
+        ssize_t sent = sendmsg(sock, &msg, flags);
+        tx_stats.syscalls++;
+
+        if (sent < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == ENOBUFS) {
+                struct pollfd pfd = {sock, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                if (use_zerocopy) reapZeroCopy(sock, false);
+                continue;
+            }
+            perror("send failed");
+            return false;
+        }
+
+        if (use_zerocopy) zc_issued++;
+        tx_stats.bytes += sent;
+        tx_stats.window_bytes += sent;
+
+        // Skip fully written vectors, then trim the partially written one
+        while (iovcnt > 0 && size_t(sent) >= iov->iov_len) {
+            sent -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (char *)iov->iov_base + sent;
+            iov->iov_len -= sent;
+        }
+    }
+
+    return true;
+}
+
+// Fills the header slot in front of the payload and sends both in place.
+// With MSG_ZEROCOPY the kernel reads the buffer after this returns, so the
+// caller reaps the completions before packing into it again.
+bool sendFrame(int sock, short *payload, int size, int camera, int flags) {
+    long syscalls_before = tx_stats.syscalls;
+
+    frameHeader *header = (frameHeader *)(payload - FRAME_HEADER_SHORTS);
+    header->size = size;
+    header->quality = quality_level;
+    header->stride = QUALITY_LADDER[quality_level].stride;
+    header->max_range = QUALITY_LADDER[quality_level].max_range * 100;
+    header->camera = camera;
+    header->flags = flags;
+    memset(header->reserved, 0, sizeof(header->reserved));
+
+    struct iovec iov;
+    iov.iov_base = header;
+    iov.iov_len = sizeof(frameHeader) + size;
+
+    bool ok = sendAll(sock, &iov, 1);
+
+    tx_stats.frames++;
+    tx_stats.window_frames++;
+    tx_stats.window_syscalls += tx_stats.syscalls - syscalls_before;
+    return ok;
+}
+
+// Prints the transmit rate once per second
+void printTxStats() {
+    double elapsed = timeMilli(TIME_NOW - tx_stats.window_start).count();
+    if (elapsed < 1000.0 || !tx_stats.window_frames) return;
+
+    std::cout << "TX: " << tx_stats.window_bytes / (elapsed * 1000.0) << " MBytes/s, " \
+        << tx_stats.window_frames * 1000.0 / elapsed << " FPS, " \
+        << float(tx_stats.window_syscalls) / tx_stats.window_frames << " syscalls/frame";
+    if (use_zerocopy)
+        std::cout << ", " << tx_stats.zc_copied << " zerocopy fallbacks";
+
+    pageFaults faults = processPageFaults();
+    std::cout << ", " << float(faults.minor - tx_stats.window_faults.minor + faults.major - tx_stats.window_faults.major) \
+        / tx_stats.window_frames << " page faults/frame" << std::endl;
+
+    printRoleUsage();
+
+    tx_stats.window_faults = faults;
+    tx_stats.window_start = TIME_NOW;
+    tx_stats.window_bytes = 0;
+    tx_stats.window_frames = 0;
+    tx_stats.window_syscalls = 0;
+}
+
+// Creates the UDP socket for the chunked transport. The destination may be
+// a unicast or multicast address; for multicast every subscriber joined to
+// the group receives the same datagrams.
+void initUDPSocket(char *address) {
+    // The chunk index of a frame is 16 bits wide
+    const int per_chunk = udpPointsPerChunk(udp_mtu);
+    if ((frame_capacity + per_chunk - 1) / per_chunk > UINT16_MAX) {
+        std::cerr << "\nMTU " << udp_mtu << " needs more than " << UINT16_MAX << " chunks for " << frame_capacity \
+            << " points per frame" << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
-        std::cerr << "\nBind failed" << std::endl;
+    char *port_str = strchr(address, ':');
+    if (port_str) {
+        *port_str = '\0';
+        udp_port = atoi(port_str + 1);
+    }
+
+    struct sockaddr_in dest_addr;
+    memset(&dest_addr, 0, sizeof(dest_addr));
+    dest_addr.sin_family = AF_INET;
+    dest_addr.sin_port = htons(udp_port);
+
+    if (inet_pton(AF_INET, address, &dest_addr.sin_addr) != 1) {
+        std::cerr << "\nInvalid UDP address " << address << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    if (listen(sockfd, 3) < 0) {
-        std::cerr << "\nListen failed" << std::endl;
+    if ((udp_sock = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0) {
+        std::cerr << "\nSocket fd not received." << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    std::cout << "Waiting for client..." << std::endl;
+    // A frame is sent as one burst of datagrams
+    int sndbuf = 8 << 20;
+    if (setsockopt(udp_sock, SOL_SOCKET, SO_SNDBUF, &sndbuf, sizeof(sndbuf))) perror("setsockopt failed");
+
+    if (IN_MULTICAST(ntohl(dest_addr.sin_addr.s_addr))) {
+        unsigned char ttl = 1;      // Stay on the camera network
+        if (setsockopt(udp_sock, IPPROTO_IP, IP_MULTICAST_TTL, &ttl, sizeof(ttl))) perror("setsockopt failed");
+    }
 
-    if ((client_sock = accept(sockfd, NULL, NULL)) < 0) {
-        std::cerr << "\nConnection failed" << std::endl;
+    if (connect(udp_sock, (struct sockaddr *) &dest_addr, sizeof(dest_addr)) < 0) {
+        std::cerr << "\nUDP connect failed" << std::endl;
         exit(EXIT_FAILURE);
     }
 
-    std::cout << "Established connection with client_sock: " << client_sock << std::endl;
+    std::cout << "Streaming UDP to " << address << ":" << udp_port << " (" \
+        << udpPointsPerChunk(udp_mtu) << " points/chunk)" << std::endl;
 }
 
-int sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer);
+// Splits the packed points into MTU sized chunks of whole points and sends
+// them with sendmmsg. With -L a share of the chunks is dropped on purpose
+// to exercise the receiver's partial frame handling.
+bool sendFrameUDP(const short *payload, int num_points) {
+    static std::vector<udpChunkHeader> headers;
+    static std::vector<struct iovec> iovs;
+    static std::vector<struct mmsghdr> msgs;
+
+    const int per_chunk = udpPointsPerChunk(udp_mtu);
+    const int num_chunks = std::max(1, (num_points + per_chunk - 1) / per_chunk);
+    long syscalls_before = tx_stats.syscalls;
+
+    headers.resize(num_chunks);
+    iovs.resize(2 * num_chunks);
+    msgs.resize(num_chunks);
+
+    int num_msgs = 0;
+    for (int c = 0; c < num_chunks; c++) {
+        if (udp_loss > 0 && rand() < udp_loss * RAND_MAX) continue;
+
+        int offset = c * per_chunk;
+        int points = std::min(per_chunk, num_points - offset);
+
+        udpChunkHeader &hdr = headers[num_msgs];
+        hdr.magic = UDP_MAGIC;
+        hdr.frame_id = udp_frame_id;
+        hdr.point_offset = offset;
+        hdr.frame_points = num_points;
+        hdr.chunk_index = c;
+        hdr.num_chunks = num_chunks;
+        hdr.num_points = points;
+        hdr.quality = quality_level;
+        hdr.reserved = 0;
+
+        struct iovec *iov = &iovs[2 * num_msgs];
+        iov[0].iov_base = &hdr;
+        iov[0].iov_len = sizeof(udpChunkHeader);
+        iov[1].iov_base = (void *)(payload + offset * UDP_POINT_SHORTS);
+        iov[1].iov_len = points * UDP_POINT_SHORTS * sizeof(short);
+
+        memset(&msgs[num_msgs], 0, sizeof(struct mmsghdr));
+        msgs[num_msgs].msg_hdr.msg_iov = iov;
+        msgs[num_msgs].msg_hdr.msg_iovlen = 2;
+        num_msgs++;
+    }
+
+    int sent = 0;
+    while (sent < num_msgs) {
+        int n = sendmmsg(udp_sock, &msgs[sent], num_msgs - sent, 0);
+        tx_stats.syscalls++;
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == ENOBUFS) {
+                struct pollfd pfd = {udp_sock, POLLOUT, 0};
+                poll(&pfd, 1, 100);
+                continue;
+            }
+            perror("UDP send failed");
+            return false;
+        }
+
+        for (int m = sent; m < sent + n; m++)
+            tx_stats.bytes += msgs[m].msg_len;
+        sent += n;
+    }
+
+    udp_frame_id++;
+    tx_stats.frames++;
+    tx_stats.window_frames++;
+    tx_stats.window_bytes += (long)num_points * UDP_POINT_SHORTS * sizeof(short);
+    tx_stats.window_syscalls += tx_stats.syscalls - syscalls_before;
+    return true;
+}
+
+// Creates the shared-memory ring a co-located consumer attaches to.
+void initSharedMemory(const char *name) {
+    std::string path = std::string("/") + name;
+    if (!shmCreate(&shm_handle, path.c_str(), sizeof(short) * 5 * frame_capacity)) {
+        perror("Shared memory setup failed");
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "Publishing frames to shared memory " << path << std::endl;
+}
+
+int sendXYZRGBPointcloud(rs2::points pts, rs2::depth_frame depth, rs2::video_frame color, short * buffer,
+                         const float *tf, rayLUT &lut, backgroundModel &background, int camera);
 
 // Exit gracefully by closing all open sockets and freeing buffer
 void sigintHandler(int dummy) {
@@ -119,13 +446,43 @@ void sigintHandler(int dummy) {
 }
 
 void print_usage() {
-    printf("\nUsage: pcs-camera-test-samples -f <samples.bag> -v (visualize)\n\n");
+    printf("\nUsage: pcs-camera-optimized [options]\n\n");
+    printf("Options:\n");
+    printf(" -h            Display command line options\n");
+    printf(" -f <file>     Read frames from a .bag file instead of the camera\n");
+    printf("               (several comma separated files stand in for several cameras)\n");
+    printf(" -D            Drive every connected camera, one pipeline per serial number\n");
+    printf(" -s            Send the pointcloud to the central computer\n");
+    printf(" -t <threads>  Number of OpenMP threads\n");
+    printf(" -c            Cut off points outside of the x/z range\n");
+    printf(" -m            Transform the points into the global frame before sending\n");
+    printf(" -n            Send geometry only, with the color fields zeroed\n");
+    printf(" -a            Align color to depth and read it in lockstep with the points\n");
+    printf(" -b <frames>   Time align-then-pack against the texcoord gather per profile, then exit\n");
+    printf(" -B <passes>   Replay the -f recording frame by frame, not in real time, timing the full path\n");
+    printf(" -R            Load the recording into memory before the -B passes\n");
+    printf(" -l            Deproject through the precomputed per-pixel ray LUT\n");
+    printf(" -g <frames>[:<refresh>] Learn the static background over <frames>, then send only the\n");
+    printf("               foreground, with the background every <refresh> frames (default %d)\n", BG_REFRESH);
+    printf(" -Z            Send with MSG_ZEROCOPY\n");
+    printf(" -u <addr:port> Stream over UDP (unicast or multicast) instead of TCP\n");
+    printf(" -M <mtu>      MTU used to size UDP chunks (default %d)\n", UDP_MTU);
+    printf(" -L <percent>  Drop this share of UDP chunks to test loss handling\n");
+    printf(" -S <name>     Publish frames to the shared-memory ring /<name> for a local consumer\n");
+    printf(" -k <file>     Load this camera's transform from a pcs-calibrate file\n");
+    printf(" -i <index>    Camera index in the calibration file (default 0), of the first camera with -D\n");
+    printf(" -X            Lock the frame buffers in RAM\n");
+    printf(" -A <role>=<cpus>[:<prio>] Pin capture or compute threads, optionally SCHED_FIFO\n");
+    printf(" -Q <fps>[:<ms>] Trade points for frame rate and latency (default budget %d ms)\n", QUALITY_LATENCY_MS);
+    printf(" -p <profile>  Capture profile for the live camera:\n");
+    printCaptureProfiles();
+    printf("\n");
 }
 
 // Parse arguments for extra runtime options
 void parseArgs(int argc, char** argv) {
     int c;
-    while ((c = getopt(argc, argv, "hf:vst:cmz")) != -1) {
+    while ((c = getopt(argc, argv, "hf:vst:cmnab:B:Rzlg:Zu:M:L:S:k:i:p:XA:Q:D")) != -1) {
         switch(c) {
             case 'h':
                 print_usage();
@@ -146,27 +503,478 @@ void parseArgs(int argc, char** argv) {
                 cutoff = true;
                 break;
             case 'm':
-                use_simd = true;
+                transform = true;
+                break;
+            case 'n':
+                color_mode = COLOR_NONE;
+                break;
+            case 'a':
+                color_mode = COLOR_ALIGNED;
+                break;
+            case 'b':
+                bench_frames = atoi(optarg);
+                break;
+            case 'B':
+                replay_passes = atoi(optarg);
+                break;
+            case 'R':
+                preload = true;
                 break;
             case 'z':
                 compress = true;
                 break;
+            case 'l':
+                use_lut = true;
+                break;
+            case 'g':
+                bg_learn = std::max(atoi(optarg), 1);
+                if (strchr(optarg, ':')) bg_refresh = std::max(atoi(strchr(optarg, ':') + 1), 1);
+                break;
+            case 'Z':
+                use_zerocopy = true;
+                break;
+            case 'u':
+                udp_address = optarg;
+                break;
+            case 'M':
+                udp_mtu = atoi(optarg);
+                if (udp_mtu < UDP_MIN_MTU || udp_mtu > UDP_MAX_MTU) {
+                    std::cerr << "Bad MTU " << optarg << ", expected " << UDP_MIN_MTU << "-" << UDP_MAX_MTU << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'L':
+                udp_loss = atof(optarg) / 100.0;
+                break;
+            case 'S':
+                shm_name = optarg;
+                break;
+            case 'k':
+                calibration_file = optarg;
+                break;
+            case 'i':
+                camera_index = atoi(optarg);
+                break;
+            case 'D':
+                all_devices = true;
+                break;
+            case 'X':
+                lock_memory = true;
+                break;
+            case 'Q':
+                quality_fps = atof(optarg);
+                if (strchr(optarg, ':')) quality_latency = atof(strchr(optarg, ':') + 1);
+                break;
+            case 'A':
+                if (!parseAffinity(optarg)) {
+                    std::cerr << "Bad affinity " << optarg << ", expected <role>=<cpus>[:<priority>]" << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                break;
+            case 'p':
+                if ((capture_profile = findCaptureProfile(optarg)) == NULL) {
+                    std::cerr << "Unknown capture profile " << optarg << ", available:" << std::endl;
+                    printCaptureProfiles();
+                    exit(EXIT_FAILURE);
+                }
+                break;
+        }
+    }
+}
+
+// Replaces the built-in transform with the camera's entry in the calibration file.
+void loadTransform(const char *path, int index) {
+    if (!loadCalibration(path, index, tf_mat)) {
+        std::cerr << "\nNo transform for camera " << index << " in " << path << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Loaded transform of camera " << index << " from " << path << std::endl;
+}
+
+// Sizes a frame buffer per camera for the largest depth stream: the frame
+// header slot and five shorts per point. The buffers and the LUT planes share
+// one pre-faulted huge page arena.
+std::vector<short *> allocateFrameBuffers(const std::vector<rs2::pipeline_profile> &selections) {
+    for (const rs2::pipeline_profile &selection : selections) {
+        auto depth_stream = selection.get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>();
+        frame_capacity = std::max(frame_capacity, depth_stream.width() * depth_stream.height());
+
+        std::cout << "Depth stream " << depth_stream.width() << " x " << depth_stream.height() << " @ " \
+            << depth_stream.fps() << " FPS" << std::endl;
+    }
+
+    fillStreamHeader(stream_header, selections[0]);
+    stream_header.max_points = frame_capacity;
+    stream_header.cameras = selections.size();
+
+    size_t frame_bytes = sizeof(short) * (FRAME_HEADER_SHORTS + 5 * frame_capacity);
+    size_t lut_bytes = use_lut ? rayLUTBytes(frame_capacity) : 0;
+    size_t bg_bytes = bg_learn ? backgroundBytes(frame_capacity) : 0;
+    std::cout << float(frame_bytes) / (1<<20) << " MBytes frame buffer per camera" << std::endl;
+
+    if (!arenaCreate(&frame_arena, selections.size() * (frame_bytes + lut_bytes + bg_bytes), -1, lock_memory)) {
+        perror("Frame arena allocation failed");
+        exit(EXIT_FAILURE);
+    }
+    std::cout << "Frame arena: " << float(frame_arena.size) / (1<<20) << " MBytes of " << arenaPageType(&frame_arena) \
+        << (frame_arena.locked ? ", locked" : "") << std::endl;
+
+    std::vector<short *> buffers;
+    for (size_t i = 0; i < selections.size(); i++)
+        buffers.push_back((short *)arenaAlloc(&frame_arena, frame_bytes));
+    return buffers;
+}
+
+// A camera driven by this server when it drives several (-D, or several
+// files with -f). They share the OpenMP team and the connection; each
+// frame carries its camera's index.
+struct edgeCamera {
+    std::string source;                 // Serial number or recording
+    rs2::pipeline pipe;
+    rs2::pointcloud pc;
+    rs2::align align_to_depth{RS2_STREAM_DEPTH};
+    float tf[16];
+    rayLUT lut;
+    backgroundModel background;
+    short *buffer = NULL;
+};
+
+// Splits the comma separated list of -f.
+std::vector<std::string> splitSources(const char *list) {
+    std::vector<std::string> sources;
+    if (!list) return sources;
+
+    std::string rest(list);
+    size_t sep;
+    while ((sep = rest.find(',')) != std::string::npos) {
+        if (sep) sources.push_back(rest.substr(0, sep));
+        rest = rest.substr(sep + 1);
+    }
+    if (!rest.empty()) sources.push_back(rest);
+    return sources;
+}
+
+// Drives a pipeline per connected device, by serial number, or per
+// recording. Camera k takes entry camera_index + k of the calibration file.
+// Each pull request is answered with one frame per camera, in camera order.
+void runMultiCamera(const std::vector<std::string> &files) {
+    std::vector<std::string> sources = files;
+    if (sources.empty()) {
+        rs2::context ctx;
+        for (auto &&device : ctx.query_devices())
+            sources.push_back(device.get_info(RS2_CAMERA_INFO_SERIAL_NUMBER));
+    }
+
+    if (sources.empty() || sources.size() > 255) {
+        std::cerr << "\nFound " << sources.size() << " cameras, expected 1 to 255" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (udp_address || shm_name) {
+        std::cerr << "\nSeveral cameras are only streamed over TCP" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    num_cameras = sources.size();
+    std::vector<std::unique_ptr<edgeCamera>> cameras;
+    std::vector<rs2::pipeline_profile> selections;
+
+    for (int k = 0; k < num_cameras; k++) {
+        std::unique_ptr<edgeCamera> camera(new edgeCamera);
+        camera->source = sources[k];
+        memcpy(camera->tf, tf_mat, sizeof(tf_mat));
+        if (calibration_file && !loadCalibration(calibration_file, camera_index + k, camera->tf)) {
+            std::cerr << "\nNo transform for camera " << camera_index + k << " in " << calibration_file << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        rs2::config cfg;
+        if (files.empty()) {
+            cfg.enable_device(sources[k]);
+            if (capture_profile) enableCaptureProfile(cfg, capture_profile);
+        }
+        else cfg.enable_device_from_file(sources[k]);
+        rs2::pipeline_profile selection = camera->pipe.start(cfg);
+
+        // Turn off laser emitter for better accuracy with multiple camera setup
+        auto depth_sensor = selection.get_device().first<rs2::depth_sensor>();
+        if (files.empty() && depth_sensor.supports(RS2_OPTION_EMITTER_ENABLED))
+            depth_sensor.set_option(RS2_OPTION_EMITTER_ENABLED, 0.f);
+
+        std::cout << "Camera " << k << ": " << sources[k] << std::endl;
+        selections.push_back(selection);
+        cameras.push_back(std::move(camera));
+    }
+
+    std::vector<short *> buffers = allocateFrameBuffers(selections);
+    for (int k = 0; k < num_cameras; k++)
+        cameras[k]->buffer = buffers[k];
+
+    initSocket(PORT);
+
+    char pull_request[1] = {0};
+    bool connected = true;
+    while (connected) {
+        if (recv(client_sock, pull_request, 1, 0) <= 0) {
+            std::cout << "Client disconnected" << std::endl;
+            break;
+        }
+        if (pull_request[0] != 'Z') {
+            std::cerr << "Faulty pull request" << std::endl;
+            exit(EXIT_FAILURE);
+        }
+
+        for (int k = 0; k < num_cameras && connected; k++) {
+            edgeCamera &camera = *cameras[k];
+
+            // Depth may run faster than color, wait for a frameset with both
+            auto frames = camera.pipe.wait_for_frames();
+            while (!frames.get_color_frame())
+                frames = camera.pipe.wait_for_frames();
+            if (color_mode == COLOR_ALIGNED)
+                frames = camera.align_to_depth.process(frames);
+
+            rs2::video_frame color = frames.get_color_frame();
+            rs2::depth_frame depth = frames.get_depth_frame();
+            rs2::points pts;
+            if (!use_lut) {
+                if (color_mode == COLOR_GATHER) camera.pc.map_to(color);
+                pts = camera.pc.calculate(depth);
+            }
+
+            if (sendXYZRGBPointcloud(pts, depth, color, camera.buffer, camera.tf, camera.lut, camera.background, k) < 0) {
+                std::cout << "Client disconnected" << std::endl;
+                connected = false;
+            }
         }
+        printTxStats();
+    }
+
+    for (auto &camera : cameras)
+        camera->pipe.stop();
+    close(client_sock);
+    close(sockfd);
+}
+
+// Times one way of coloring the points over the given number of frames:
+// preparing them (align, or map_to) with pc.calculate, then packing.
+void benchColorMode(rs2::pipeline &pipe, const char *name, colorMode mode, int frames, std::vector<short> &buffer) {
+    rs2::pointcloud pc;
+    rs2::align align_to_depth(RS2_STREAM_DEPTH);
+    packKernel kernel = selectPackKernel(cutoff, transform, mode);
+    packParams params = {tf_mat, num_of_threads};
+    double prepare_ms = 0, pack_ms = 0;
+
+    for (int i = 0; i < frames; i++) {
+        rs2::frameset frames_in = pipe.wait_for_frames();
+        while (!frames_in.get_color_frame())
+            frames_in = pipe.wait_for_frames();
+
+        timestamp start = TIME_NOW;
+        rs2::frameset aligned = mode == COLOR_ALIGNED ? align_to_depth.process(frames_in) : frames_in;
+        rs2::video_frame color = aligned.get_color_frame();
+        rs2::depth_frame depth = aligned.get_depth_frame();
+        if (mode == COLOR_GATHER) pc.map_to(color);
+        rs2::points pts = pc.calculate(depth);
+        timestamp prepared = TIME_NOW;
+
+        kernel(makePackSource(pts, color), params, buffer.data());
+        timestamp packed = TIME_NOW;
+
+        prepare_ms += timeMilli(prepared - start).count();
+        pack_ms += timeMilli(packed - prepared).count();
+    }
+
+    printf("%-12s %-8s %10.2f %10.2f %10.2f\n", name, mode == COLOR_ALIGNED ? "align" : "gather",
+           prepare_ms / frames, pack_ms / frames, (prepare_ms + pack_ms) / frames);
+}
+
+// Compares align-then-pack with the texcoord gather at every capture
+// profile the camera supports, or at the recording's own with -f. Times
+// are per frame, in ms.
+void benchColor(int frames) {
+    printf("\n%-12s %-8s %10s %10s %10s\n", "profile", "color", "prepare", "pack", "total");
+
+    for (int p = 0; p < (filename ? 1 : NUM_CAPTURE_PROFILES); p++) {
+        const char *name = filename ? "file" : CAPTURE_PROFILES[p].name;
+        rs2::pipeline pipe;
+        rs2::config cfg;
+        if (filename) cfg.enable_device_from_file(filename);
+        else enableCaptureProfile(cfg, &CAPTURE_PROFILES[p]);
+
+        rs2::pipeline_profile selection;
+        try {
+            selection = pipe.start(cfg);
+        }
+        catch (const rs2::error &e) {
+            printf("%-12s not supported by this camera\n", name);
+            continue;
+        }
+
+        auto depth_stream = selection.get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>();
+        std::vector<short> buffer(5 * depth_stream.width() * depth_stream.height());
+
+        // Let auto exposure settle before timing
+        for (int i = 0; i < 30; i++) pipe.wait_for_frames();
+
+        benchColorMode(pipe, name, COLOR_GATHER, frames, buffer);
+        benchColorMode(pipe, name, COLOR_ALIGNED, frames, buffer);
+        pipe.stop();
+    }
+}
+
+// Starts playing the recording once through, delivering every frame
+// regardless of how long processing takes.
+rs2::pipeline_profile startPlayback(rs2::pipeline &pipe) {
+    rs2::config cfg;
+    cfg.enable_device_from_file(filename, false);
+    rs2::pipeline_profile selection = pipe.start(cfg);
+    selection.get_device().as<rs2::playback>().set_real_time(false);
+    return selection;
+}
+
+// Runs one frame through the full path, from the frameset to the packed
+// (and with -s sent) points. Returns the points packed, -1 if the client
+// disconnected.
+int replayFrame(const rs2::frameset &frames, rs2::pointcloud &pc, rs2::align &align_to_depth, short *buffer) {
+    rs2::frameset aligned = color_mode == COLOR_ALIGNED ? align_to_depth.process(frames) : frames;
+    rs2::video_frame color = aligned.get_color_frame();
+    rs2::depth_frame depth = aligned.get_depth_frame();
+    rs2::points pts;
+    if (!use_lut) {
+        if (color_mode == COLOR_GATHER) pc.map_to(color);
+        pts = pc.calculate(depth);
+    }
+
+    int size = sendXYZRGBPointcloud(pts, depth, color, buffer, tf_mat, ray_lut, background, 0);
+    return size < 0 ? -1 : size / (5 * sizeof(short));
+}
+
+// Deterministic benchmark of the -f recording. Playback does not follow the
+// wall clock, so each pass processes every frame exactly once, as fast as
+// the path allows, and ends with the file. With -R the frames are loaded
+// into memory first, keeping disk I/O and decompression out of the times.
+// The timed path is align or map_to, pc.calculate, packing and, with -s,
+// sending. The quality controller is off, so each pass packs the same
+// points.
+void benchRecording(int passes) {
+    if (!filename) {
+        std::cerr << "\n-B replays a recording, give it with -f" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    quality_fps = 0;
+
+    rs2::pipeline pipe;
+    rs2::pointcloud pc;
+    rs2::align align_to_depth(RS2_STREAM_DEPTH);
+    short *buffer = allocateFrameBuffers({startPlayback(pipe)})[0];
+    if (send_buffer) initSocket(PORT);
+
+    std::vector<rs2::frameset> loaded;
+    if (preload) {
+        rs2::frameset frames;
+        while (pipe.try_wait_for_frames(&frames, 1000)) {
+            frames.keep();
+            loaded.push_back(frames);
+        }
+        pipe.stop();
+        std::cout << "Loaded " << loaded.size() << " framesets" << std::endl;
+    }
+
+    printf("\n%-6s %8s %12s %10s %10s %10s %10s\n", "pass", "frames", "points", "mean ms", "median ms", "max ms", "FPS");
+    std::vector<double> frame_ms;
+
+    for (int pass = 0; pass < passes; pass++) {
+        frame_ms.clear();
+        long points = 0;
+        size_t next = 0;
+        if (!preload && pass > 0) startPlayback(pipe);
+
+        // Every pass learns the background from scratch, as a fresh run would
+        if (background.size) resetBackground(background);
+
+        while (true) {
+            rs2::frameset frames;
+            if (preload) {
+                if (next == loaded.size()) break;
+                frames = loaded[next++];
+            }
+            else if (!pipe.try_wait_for_frames(&frames, 1000)) break;
+
+            timestamp start = TIME_NOW;
+            int packed = replayFrame(frames, pc, align_to_depth, buffer);
+            frame_ms.push_back(timeMilli(TIME_NOW - start).count());
+
+            if (packed < 0) {
+                std::cout << "Client disconnected" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            points += packed;
+        }
+        if (!preload) pipe.stop();
+        if (frame_ms.empty()) continue;
+
+        double total = 0;
+        for (double ms : frame_ms) total += ms;
+        std::vector<double> sorted = frame_ms;
+        std::sort(sorted.begin(), sorted.end());
+
+        printf("%-6d %8zu %12ld %10.3f %10.3f %10.3f %10.1f\n", pass, frame_ms.size(), points, total / frame_ms.size(),
+               sorted[sorted.size() / 2], sorted.back(), 1000.0 * frame_ms.size() / total);
+    }
+
+    if (send_buffer) {
+        close(client_sock);
+        close(sockfd);
     }
 }
 
 int main (int argc, char** argv) {
     parseArgs(argc, argv);              // Parse Arguments
+    if (bg_learn && (udp_address || shm_name)) {
+        std::cerr << "\nBackground removal (-g) is only streamed over TCP" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    if (calibration_file) loadTransform(calibration_file, camera_index);
     signal(SIGINT, sigintHandler);      // Set interrupt signal
+
+    // Pin before the pipeline starts, so the librealsense threads inherit the capture CPUs
+    printAffinity();
+    pinThread(ROLE_CAPTURE);
+    if (num_of_threads > 1) pinComputeTeam(num_of_threads);
+
+    if (bench_frames > 0) {
+        benchColor(bench_frames);
+        return 0;
+    }
+
+    if (replay_passes > 0) {
+        benchRecording(replay_passes);
+        arenaDestroy(&frame_arena);
+        return 0;
+    }
     
+    // Several devices or recordings are driven from one process
+    std::vector<std::string> files = splitSources(filename);
+    if (all_devices || files.size() > 1) {
+        send_buffer = true;
+        runMultiCamera(files);
+        arenaDestroy(&frame_arena);
+        return 0;
+    }
+
     int buff_size = 0, buff_size_sum = 0;
-    short *buffer = (short *)malloc(sizeof(short) * BUF_SIZE);
+    short *buffer = NULL;
     
     if (filename == NULL) {
         char pull_request[1] = {0};
         rs2::pointcloud pc;
+        rs2::align align_to_depth(RS2_STREAM_DEPTH);
         rs2::pipeline pipe;
-        rs2::pipeline_profile selection = pipe.start();
+        rs2::config cfg;
+        if (capture_profile) enableCaptureProfile(cfg, capture_profile);
+        rs2::pipeline_profile selection = pipe.start(cfg);
+        buffer = allocateFrameBuffers({selection})[0];
         rs2::device selected_device = selection.get_device();
         auto depth_sensor = selected_device.first<rs2::depth_sensor>();
 
@@ -174,7 +982,12 @@ int main (int argc, char** argv) {
         if (depth_sensor.supports(RS2_OPTION_EMITTER_ENABLED))
             depth_sensor.set_option(RS2_OPTION_EMITTER_ENABLED, 0.f);
 
-        initSocket(PORT);
+        if (shm_name)
+            initSharedMemory(shm_name);
+        else if (udp_address)
+            initUDPSocket(udp_address);
+        else
+            initSocket(PORT);
         signal(SIGINT, sigintHandler);
 
         // Loop until client disconnected
@@ -182,8 +995,11 @@ int main (int argc, char** argv) {
             // if (timer)
             //     frame_start = TIME_NOW;
             
-            // Wait for pull request
-            if (recv(client_sock, pull_request, 1, 0) < 0) {
+            // Wait for pull request. UDP and shared memory push every frame without one.
+            if (udp_address || shm_name) {
+                pull_request[0] = 'Z';
+            }
+            else if (recv(client_sock, pull_request, 1, 0) < 0) {
                 std::cout << "Client disconnected" << std::endl;
                 break;
             }
@@ -193,23 +1009,36 @@ int main (int argc, char** argv) {
                 // }
 
                 // Grab depth and color frames, and map each point to a color value
+                // Depth may run faster than color, wait for a frameset with both
                 auto frames = pipe.wait_for_frames();
+                while (!frames.get_color_frame())
+                    frames = pipe.wait_for_frames();
+                if (color_mode == COLOR_ALIGNED)
+                    frames = align_to_depth.process(frames);
                 auto color = frames.get_color_frame();
 
                 // if (timer) {
                 //     grab_frame_end_calculate_start = TIME_NOW;
                 // }
-                pc.map_to(color);  // Maps color values to a point in 3D space
-
                 auto depth = frames.get_depth_frame();
+                rs2::points pts;
 
-                auto pts = pc.calculate(depth);
+                // The ray LUT deprojects straight from the depth frame
+                if (!use_lut) {
+                    if (color_mode == COLOR_GATHER) pc.map_to(color);  // Maps color values to a point in 3D space
+                    pts = pc.calculate(depth);
+                }
 
                 // if (timer) {
                 //     calculate_end = TIME_NOW;
                 // }
 
-                buff_size = sendXYZRGBPointcloud(pts, color, buffer);
+                buff_size = sendXYZRGBPointcloud(pts, depth, color, buffer, tf_mat, ray_lut, background, 0);
+                if (buff_size < 0) {
+                    std::cout << "Client disconnected" << std::endl;
+                    break;
+                }
+                printTxStats();
             }
             else {                                     // Did not receive a correct pull request
                 std::cerr << "Faulty pull request" << std::endl;
@@ -226,9 +1055,11 @@ int main (int argc, char** argv) {
         rs2::config cfg;
         rs2::pipeline pipe;
         rs2::pointcloud pc;
+        rs2::align align_to_depth(RS2_STREAM_DEPTH);
         
         cfg.enable_device_from_file(filename);
         rs2::pipeline_profile selection = pipe.start(cfg);
+        buffer = allocateFrameBuffers({selection})[0];
 
         rs2::device device = pipe.get_active_profile().get_device();
         std::cout << "Camera Info: " << device.get_info(RS2_CAMERA_INFO_NAME) << " FW ver:" << device.get_info(RS2_CAMERA_INFO_FIRMWARE_VERSION) << std::endl;
@@ -268,7 +1099,9 @@ int main (int argc, char** argv) {
         
         rs2::frameset frames;
 
-        if (send_buffer) initSocket(PORT);
+        if (shm_name) initSharedMemory(shm_name);
+        else if (udp_address) initUDPSocket(udp_address);
+        else if (send_buffer) initSocket(PORT);
         
         while (true)
         {    
@@ -290,15 +1123,24 @@ int main (int argc, char** argv) {
                 //use frames here
                 
                                                                     // stairs.bag vs sample.bag
-                rs2::video_frame color = frames.get_color_frame();  // 0.003 ms vs 0.001ms
-                rs2::depth_frame depth = frames.get_depth_frame();  // 0.001ms vs 0.001ms
-                rs2::points pts = pc.calculate(depth);              // 27ms vs 27ms            
-                pc.map_to(color);       // 0.01ms vs 0.02ms  // Maps color values to a point in 3D space
+                rs2::frameset aligned = color_mode == COLOR_ALIGNED ? align_to_depth.process(frames) : frames;
+                rs2::video_frame color = aligned.get_color_frame();  // 0.003 ms vs 0.001ms
+                rs2::depth_frame depth = aligned.get_depth_frame();  // 0.001ms vs 0.001ms
+                rs2::points pts;
+                if (!use_lut) {
+                    if (color_mode == COLOR_GATHER) pc.map_to(color);   // 0.01ms vs 0.02ms  // Maps color values to a point in 3D space
+                    pts = pc.calculate(depth);                      // 27ms vs 27ms
+                }
                 
                 time_start = TIME_NOW;
-                buff_size = sendXYZRGBPointcloud(pts, color, buffer);   // 86ms vs 9.7ms
+                buff_size = sendXYZRGBPointcloud(pts, depth, color, buffer, tf_mat, ray_lut, background, 0);   // 86ms vs 9.7ms
                 time_end = TIME_NOW;
 
+                if (buff_size < 0) {
+                    std::cout << "Client disconnected" << std::endl;
+                    break;
+                }
+
                 std::cout << "Frame Time: " << timeMilli(time_end - time_start).count() \
                     << " ms " << "FPS: " << 1000.0 / timeMilli(time_end - time_start).count() \
                     << "\t Buffer size: " << float(buff_size)/(1<<20) << " MBytes" << std::endl;
@@ -315,6 +1157,8 @@ int main (int argc, char** argv) {
             close(client_sock);
             close(sockfd);
         }
+        if (udp_address) close(udp_sock);
+        if (shm_name) shmClose(&shm_handle);
 
         // Use last Frame to display frame Info
         rs2::video_frame color = frames.get_color_frame();
@@ -347,336 +1191,144 @@ int main (int argc, char** argv) {
             std::cout << "\n### AVG Bytes/Frame: " << float(buff_size_sum) / (i*1000000) << " MBytes" << std::endl;
             std::cout << "### AVG Filter Compress Ratio " << float(buff_size_sum) / ( (pts.size()/100) * 5 * sizeof(short) * i) << " %" << std::endl;
         }
+
+        if ((send_buffer || udp_address || shm_name) && tx_stats.frames)
+        {
+            std::cout << "\n### AVG Send Rate: " << tx_stats.bytes / (duration_sum * 1000.0) << " MBytes/s" << std::endl;
+            std::cout << "### AVG Syscalls/Frame: " << float(tx_stats.syscalls) / tx_stats.frames << std::endl;
+            if (use_zerocopy)
+                std::cout << "### Zerocopy Fallbacks: " << tx_stats.zc_copied << std::endl;
+        }
     }
 
-    free(buffer);
+    // The frame buffers, LUT planes and background models live in the arena
+    arenaDestroy(&frame_arena);
     return 0;
 }
 
-bool initialized = false;
-int pts_size;
-int w, h, cl_bp, cl_sb, w_min, h_min;
-
-// TODO CLEAN
-float conv_rate, point5f, w_f, h_f, h_min_f, cl_bp_f, cl_sb_f;
-
-// Float
-__m128 _conv_rate, _cl_bp_f, _cl_sb_f, _f5, _w, _h, z_lo, z_hi, x_lo, x_hi;
-
-// integ
-__m128i _zero, _w_min, _h_min, _cl_bp, _cl_sb;
-
-
-int copyPointCloudXYZRGBToBufferSIMD(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer)
-{
-    const auto vert = pts.get_vertices();
-    const rs2::texture_coordinate* tcrd = pts.get_texture_coordinates();
-    const uint8_t* color_data = reinterpret_cast<const uint8_t*>(color.get_data());
-
-    if (!initialized){
-        initialized = true;
-        pts_size = pts.size();
-        w = color.get_width();
-        h = color.get_height();
-        cl_bp = color.get_bytes_per_pixel();
-        cl_sb = color.get_stride_in_bytes();
-        w_min = (w - 1);
-        h_min = (h - 1);
-
-        // TODO CLEAN
-        conv_rate = CONV_RATE;
-        point5f = .5f;
-        w_f = float(w);
-        h_f = float(h);
-        //w_min_f = float(w_min);
-        //h_min_f = float(h_min);
-        cl_bp_f = float(cl_bp);
-        cl_sb_f = float(cl_sb);
-
-        // Float
-        _conv_rate = _mm_broadcast_ss(&conv_rate);
-        _cl_bp_f = _mm_broadcast_ss(&cl_bp_f);
-        _cl_sb_f = _mm_broadcast_ss(&cl_sb_f);
-        //_h_min_f = _mm_broadcast_ss(&h_min_f);
-        _f5 = _mm_broadcast_ss(&point5f);
-        
-        _w = _mm_broadcast_ss(&w_f);
-        _h = _mm_broadcast_ss(&h_f);
-        z_lo = _mm_set_ps1(0);
-        z_hi = _mm_set_ps1(1.5);
-        x_lo = _mm_set_ps1(-2);
-        x_hi = _mm_set_ps1(2);
-
-        // integ
-        _zero = _mm_setzero_si128();
-        _w_min = _mm_set1_epi32(w_min);
-        _h_min = _mm_set1_epi32(h_min);
-        _cl_bp = _mm_set1_epi32(cl_bp);
-        const __m128i _cl_sb = _mm_set1_epi32(cl_sb);
+// Drops points for the current quality level, compacting the packed frame
+// in place. Returns the number of points kept.
+int applyQuality(short *payload, int num_points, const float *tf) {
+    const qualityLevel &level = QUALITY_LADDER[quality_level];
+    if (level.stride == 1 && level.max_range == 0) return num_points;
+
+    // Transformed points are measured from the camera position, the others from the origin
+    const bool moved = transform || use_lut;
+    const float cam_x = moved ? tf[3] * CONV_RATE : 0, cam_y = moved ? tf[7] * CONV_RATE : 0, cam_z = moved ? tf[11] * CONV_RATE : 0;
+    const float max_sq = level.max_range * CONV_RATE * level.max_range * CONV_RATE;
+    int kept = 0;
+
+    for (int i = 0; i < num_points; i += level.stride) {
+        const short *p = &payload[i * 5];
+        if (level.max_range) {
+            float dx = p[0] - cam_x, dy = p[1] - cam_y, dz = p[2] - cam_z;
+            if (dx * dx + dy * dy + dz * dz > max_sq) continue;
+        }
+        if (kept != i) memcpy(&payload[kept * 5], p, 5 * sizeof(short));
+        kept++;
     }
-    
-    int global_count = 0;
-    
-    #pragma omp parallel for ordered schedule(static, 10000) num_threads(num_of_threads)
-    for (int i = 0; i < pts_size; i += 4) {
-            //unsigned int id = omp_get_thread_num();
-        
-        int i1 = i;
-        int i2 = i+1;
-        int i3 = i+2;
-        int i4 = i+3;
-
-        __attribute__((aligned(16))) float v_temp1[4];
-        __attribute__((aligned(16))) float v_temp2[4];
-        __attribute__((aligned(16))) float v_temp3[4];
-        __attribute__((aligned(16))) float v_temp4[4];
-
-        __attribute__((aligned(16))) int idx[4];
-        __attribute__((aligned(16))) int idy[4];
-
-        // load
-        __m128 _x = _mm_set_ps(tcrd[i1].u, tcrd[i2].u, tcrd[i3].u, tcrd[i4].u); // load u
-        __m128 _y = _mm_set_ps(tcrd[i1].v, tcrd[i2].v, tcrd[i3].v, tcrd[i4].v); // load v
-
-        _x = _mm_fmadd_ps(_x, _w, _f5); // fma
-        _y = _mm_fmadd_ps(_y, _h, _f5);
-
-        // float to int
-        __m128i _xi = _mm_cvttps_epi32(_x);
-        __m128i _yi = _mm_cvttps_epi32(_y);
-
-        _xi = _mm_max_epi32(_xi, _zero);    // max
-        _yi = _mm_max_epi32(_yi, _zero);
-        _xi = _mm_min_epi32(_xi, _w_min);   // min
-        _yi = _mm_min_epi32(_yi, _h_min);
-        
-        _mm_storeu_si128((__m128i_u*)idx, _xi);
-        _mm_storeu_si128((__m128i_u*)idy, _yi);
-
-        int idx1 = idx[3]*cl_bp + idy[3]*cl_sb;
-        int idx2 = idx[2]*cl_bp + idy[2]*cl_sb;
-        int idx3 = idx[1]*cl_bp + idy[1]*cl_sb;
-        int idx4 = idx[0]*cl_bp + idy[0]*cl_sb;
-
-        // Point Transformation using SIMD instructions for Matrix Multiplication on xyz points
-        __m128 ss_x1 = _mm_broadcast_ss(&vert[i].x);
-        __m128 ss_y1 = _mm_broadcast_ss(&vert[i].y);
-        __m128 ss_z1 = _mm_broadcast_ss(&vert[i].z);
-
-        __m128 ss_x2 = _mm_broadcast_ss(&vert[i2].x);
-        __m128 ss_y2 = _mm_broadcast_ss(&vert[i2].y);
-        __m128 ss_z2 = _mm_broadcast_ss(&vert[i2].z);
-
-        __m128 ss_x3 = _mm_broadcast_ss(&vert[i3].x);
-        __m128 ss_y3 = _mm_broadcast_ss(&vert[i3].y);
-        __m128 ss_z3 = _mm_broadcast_ss(&vert[i3].z);
-
-        __m128 ss_x4 = _mm_broadcast_ss(&vert[i4].x);
-        __m128 ss_y4 = _mm_broadcast_ss(&vert[i4].y);
-        __m128 ss_z4 = _mm_broadcast_ss(&vert[i4].z);
-
-        __m128 _v1 = _mm_fmadd_ps(ss_x1, ss_a, ss_d);
-        _v1 = _mm_fmadd_ps(ss_y1, ss_b, _v1);
-        _v1 = _mm_fmadd_ps(ss_z1, ss_c, _v1);
-
-        __m128 _v2 = _mm_fmadd_ps(ss_x2, ss_a, ss_d);
-        _v2 = _mm_fmadd_ps(ss_y2, ss_b, _v2);
-        _v2 = _mm_fmadd_ps(ss_z2, ss_c, _v2);
-
-        __m128 _v3 = _mm_fmadd_ps(ss_x3, ss_a, ss_d);
-        _v3 = _mm_fmadd_ps(ss_y3, ss_b, _v3);
-        _v3 = _mm_fmadd_ps(ss_z3, ss_c, _v3);
-
-        __m128 _v4 = _mm_fmadd_ps(ss_x4, ss_a, ss_d);
-        _v4 = _mm_fmadd_ps(ss_y4, ss_b, _v4);
-        _v4 = _mm_fmadd_ps(ss_z4, ss_c, _v4);
-
-        // SIMD multiply by conversion rate to be converted from floats to shorts later
-        _v1 = _mm_mul_ps(_v1, _conv_rate); // multiply with _conv_rate
-        _v2 = _mm_mul_ps(_v2, _conv_rate); // multiply with _conv_rate
-        _v3 = _mm_mul_ps(_v3, _conv_rate); // multiply with _conv_rate
-        _v4 = _mm_mul_ps(_v4, _conv_rate); // multiply with _conv_rate
-
-        // Store SIMD Vectors into memory (arrays) 
-        _mm_store_ps(v_temp1, _v1);
-        _mm_store_ps(v_temp2, _v2);
-        _mm_store_ps(v_temp3, _v3);
-        _mm_store_ps(v_temp4, _v4);
-
-        if (cutoff) {
-            // Check if x and z points are within range
-            __m128 z_pts = _mm_set_ps(vert[i].z, vert[i2].z, vert[i3].z, vert[i4].z);
-            __m128 x_pts = _mm_set_ps(vert[i].x, vert[i2].x, vert[i3].x, vert[i4].x);
-
-            __m128 z_gt_lo = _mm_cmpgt_ps(z_pts, z_lo);
-            __m128 z_le_hi = _mm_cmple_ps(z_pts, z_hi);
-            __m128 x_gt_lo = _mm_cmpgt_ps(x_pts, x_lo);
-            __m128 x_le_hi = _mm_cmple_ps(x_pts, x_hi);
-
-            __m128 z_mask = _mm_and_ps(z_gt_lo, z_le_hi);
-            __m128 x_mask = _mm_and_ps(x_gt_lo, x_le_hi);
-            __m128 pt_mask = _mm_and_ps(z_mask, x_mask);
-
-            float pt_mask_f[4];
-            _mm_store_ps(pt_mask_f, pt_mask);
-
-            long count = -1;
-
-            //v1
-            if (pt_mask_f[0] != 0) {
-
-                #pragma omp atomic capture
-                count = global_count++;
-
-                pc_buffer[count * 5 + 0] = short(v_temp1[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp1[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp1[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx1] + (color_data[idx1 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx1 + 2];
-
-                // printf("%.2f,%.2f = %f\n", vert[i].z, vert[i].x, pt_mask_f[0]);
-            }
-            
-            //v2
-            if (pt_mask_f[1] != 0) {
-                
-                #pragma omp atomic capture
-                count = global_count++;
 
-                pc_buffer[count * 5 + 0] = short(v_temp2[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp2[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp2[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx2] + (color_data[idx2 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx2 + 2];
+    return kept;
+}
 
-                // printf("%.2f,%.2f = %f\n", vert[i2].z, vert[i2].x, pt_mask_f[1]);
-            }
-            
-            //v3
-            if (pt_mask_f[2] != 0) {
-                
-                #pragma omp atomic capture
-                count = global_count++;
-                
-                pc_buffer[count * 5 + 0] = short(v_temp3[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp3[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp3[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx3] + (color_data[idx3 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx3 + 2];
+// Bytes written to the transport socket that have not left the host yet.
+int queuedBytes() {
+    int sock = udp_address ? udp_sock : client_sock;
+    int queued = 0;
+    if (shm_name || ioctl(sock, SIOCOUTQ, &queued) < 0) return 0;
+    return queued;
+}
 
-                // printf("%.2f,%.2f = %f\n", vert[i3].z, vert[i3].x, pt_mask_f[2]);
-            }
+// Smoothed round trip time of the TCP connection, 0 for the other transports.
+float rttMilli() {
+    if (udp_address || shm_name || !send_buffer) return 0;
 
-            //v4
-            if (pt_mask_f[3] != 0) {
-                
-                #pragma omp atomic capture
-                count = global_count++;
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if (getsockopt(client_sock, IPPROTO_TCP, TCP_INFO, &info, &len) < 0) return 0;
+    return info.tcpi_rtt / 1000.0;
+}
 
-                pc_buffer[count * 5 + 0] = short(v_temp4[0]);
-                pc_buffer[count * 5 + 1] = short(v_temp4[1]);
-                pc_buffer[count * 5 + 2] = short(v_temp4[2]);
-                pc_buffer[count * 5 + 3] = color_data[idx4] + (color_data[idx4 + 1] << 8);
-                pc_buffer[count * 5 + 4] = color_data[idx4 + 2];
+// Feedback controller of the quality level. The frame latency is the pack and
+// send time, plus the time to drain the socket queue and half the RTT. When the
+// achieved frame rate or the latency misses its target the level goes down one
+// step at once; it only comes back up after a sustained run of headroom.
+void updateQuality(double frame_ms, int frame_bytes) {
+    static timestamp last_frame = TIME_NOW;
+    static double fps = quality_fps, latency = 0, bytes_per_ms = 0;
+    static int hold = 0, headroom = 0;
+
+    timestamp now = TIME_NOW;
+    double interval = timeMilli(now - last_frame).count();
+    last_frame = now;
+    if (interval <= 0) return;
+
+    fps = 0.9 * fps + 0.1 * (1000.0 / interval);
+    bytes_per_ms = 0.9 * bytes_per_ms + 0.1 * (frame_bytes / interval);
+
+    int queued = queuedBytes();
+    float rtt = rttMilli();
+    double sample = frame_ms + (bytes_per_ms > 0 ? queued / bytes_per_ms : 0) + rtt / 2;
+    latency = 0.9 * latency + 0.1 * sample;
+
+    if (hold > 0) {
+        hold--;
+        return;
+    }
 
-                // printf("%.2f,%.2f = %f\n", vert[i4].z, vert[i4].x, pt_mask_f[3]);
-            }
+    int level = quality_level;
+    if (fps < 0.9 * quality_fps || latency > quality_latency) {
+        headroom = 0;
+        level = std::min(level + 1, QUALITY_LEVELS - 1);
+    }
+    else if (fps >= 0.97 * quality_fps && latency < 0.5 * quality_latency) {
+        if (++headroom >= QUALITY_RECOVER) {
+            headroom = 0;
+            level = std::max(level - 1, 0);
         }
+    }
+    else headroom = 0;
 
-        else {
-            //v1
-            pc_buffer[i * 5 + 0] = short(v_temp1[0]);
-            pc_buffer[i * 5 + 1] = short(v_temp1[1]);
-            pc_buffer[i * 5 + 2] = short(v_temp1[2]);
-            pc_buffer[i * 5 + 3] = color_data[idx1] + (color_data[idx1 + 1] << 8);
-            pc_buffer[i * 5 + 4] = color_data[idx1 + 2];
-            
-            //v2
-            pc_buffer[i * 5 + 5] = short(v_temp2[0]);
-            pc_buffer[i * 5 + 6] = short(v_temp2[1]);
-            pc_buffer[i * 5 + 7] = short(v_temp2[2]);
-            pc_buffer[i * 5 + 8] = color_data[idx2] + (color_data[idx2 + 1] << 8);
-            pc_buffer[i * 5 + 9] = color_data[idx2 + 2];
-            
-            //v3
-            pc_buffer[i * 5 + 10] = short(v_temp3[0]);
-            pc_buffer[i * 5 + 11] = short(v_temp3[1]);
-            pc_buffer[i * 5 + 12] = short(v_temp3[2]);
-            pc_buffer[i * 5 + 13] = color_data[idx3] + (color_data[idx3 + 1] << 8);
-            pc_buffer[i * 5 + 14] = color_data[idx3 + 2];
-            
-            //v4
-            pc_buffer[i * 5 + 15] = short(v_temp4[0]);
-            pc_buffer[i * 5 + 16] = short(v_temp4[1]);
-            pc_buffer[i * 5 + 17] = short(v_temp4[2]);
-            pc_buffer[i * 5 + 18] = color_data[idx4] + (color_data[idx4 + 1] << 8);
-            pc_buffer[i * 5 + 19] = color_data[idx4 + 2];
-        }
-    
+    if (level != quality_level) {
+        std::cout << "Quality " << quality_level << " -> " << level << " (" << fps << " FPS, " \
+            << latency << " ms latency, " << queued << " bytes queued, " << rtt << " ms RTT)" << std::endl;
+        quality_level = level;
+        hold = QUALITY_HOLD;
+    }
 }
-    
-    
-    if (cutoff)
-        return global_count;
 
-    return pts_size;
+// Packs the frame with the kernel the flags pick, once per frame, so none
+// are tested per point. Returns the number of points.
+int packFrame(rs2::points &pts, rs2::depth_frame &depth, rs2::video_frame &color, short *payload,
+              const packParams &params, rayLUT &lut, backgroundMode pass) {
+    if (use_lut) {
+        if (!lut.size) initRayLUT(lut, depth, color, params.tf, &frame_arena, num_of_threads);
+        return selectLUTKernel(cutoff, color_mode, pass)(lut, depth, color, params, payload);
+    }
+    return selectPackKernel(cutoff, transform, color_mode, pass)(makePackSource(pts, color), params, payload);
 }
 
-// Converts the XYZ values into shorts for less memory overhead,
-// and puts the XYZRGB values of each point into the buffer.
-int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer) {
-
-    const auto vertices = pts.get_vertices();
-    const rs2::texture_coordinate* tex_coords = pts.get_texture_coordinates();
-    const uint8_t* color_data = reinterpret_cast<const uint8_t*>(color.get_data());
-
-    const int pts_size = pts.size();
-    const int w = color.get_width();
-    const int h = color.get_height();
-    const int cl_bp = color.get_bytes_per_pixel();
-    const int cl_sb = color.get_stride_in_bytes();
-    const int w_min = w - 1;
-    const int h_min = h - 1;
-    
-    // TODO Optimize return size
+// Sends the points the model takes for background as a FRAME_BACKGROUND
+// frame, ahead of the camera's foreground. Returns its size in bytes, -1 if
+// the client disconnected.
+int sendBackground(rs2::points &pts, rs2::depth_frame &depth, rs2::video_frame &color, short *payload,
+                   const packParams &params, rayLUT &lut, int camera) {
+    int points = packFrame(pts, depth, color, payload, params, lut, BG_BACKGROUND);
+    if (quality_fps) points = applyQuality(payload, points, params.tf);
 
-    // use 4 threads
-    #pragma omp parallel for schedule(static, 10000) num_threads(num_of_threads)
-    for (int i = 0; i < pts_size; i++) {
-
-        if (cutoff)
-        {
-            if (!vertices[i].z) continue;
-            if (!vertices[i].x) continue;
-            if (vertices[i].z > 1.5) continue;
-            if (!(-2 < vertices[i].x < 2)) continue;
-        }
-               
-        int x = std::min(std::max(int(tex_coords[i].u*w + .5f), 0), w_min);
-        int y = std::min(std::max(int(tex_coords[i].v*h + .5f), 0), h_min);
-        
-        int idx = x * cl_bp + y * cl_sb;
-
-        // float x_p = tf_mat[0] * vertices[i].x + tf_mat[1] * vertices[i].y + tf_mat[2] * vertices[i].z + tf_mat[3];
-        // float y_p = tf_mat[4] * vertices[i].x + tf_mat[5] * vertices[i].y + tf_mat[6] * vertices[i].z + tf_mat[7];
-        // float z_p = tf_mat[8] * vertices[i].x + tf_mat[9] * vertices[i].y + tf_mat[10] * vertices[i].z + tf_mat[11];
-        
-        pc_buffer[i * 5    ] = static_cast<short>( vertices[i].x * CONV_RATE);
-        pc_buffer[i * 5 + 1] = static_cast<short>( vertices[i].y * CONV_RATE);
-        pc_buffer[i * 5 + 2] = static_cast<short>( vertices[i].z * CONV_RATE);
-        pc_buffer[i * 5 + 3] = color_data[idx] + (color_data[idx + 1] << 8);
-        pc_buffer[i * 5 + 4] = color_data[idx + 2];
-    }
-
-    return pts_size;
+    int size = 5 * points * sizeof(short);
+    if (send_buffer && !sendFrame(client_sock, payload, size, camera, FRAME_BACKGROUND))
+        return -1;
 
+    // The foreground is packed into the same buffer next
+    if (use_zerocopy && send_buffer) reapZeroCopy(client_sock, true);
+    return size;
 }
 
-int sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer) {
+int sendXYZRGBPointcloud(rs2::points pts, rs2::depth_frame depth, rs2::video_frame color, short * buffer,
+                         const float *tf, rayLUT &lut, backgroundModel &background, int camera) {
     int size;
-    
-    // Clean Buffer
-    memset(buffer, 0, BUF_SIZE);
+    timestamp frame_start = TIME_NOW;
 
     //TODO some issues with the buffer offset, on the receiver buff+short but size is int
 
@@ -691,22 +1343,74 @@ int sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer
 
     // TODO Investigate https://github.com/IntelRealSense/librealsense/wiki/API-Changes#from-2161-to-2162
 
-    if (use_simd)
-    {
-        size = copyPointCloudXYZRGBToBufferSIMD(pts, color, &buffer[0] + sizeof(short));
-    }else
+    // With shared memory the kernels pack straight into the ring slot
+    short *payload = shm_name ? shmBeginWrite(&shm_handle) : buffer + FRAME_HEADER_SHORTS;
+
+    // The last frame may still be referenced by in-flight zerocopy sends
+    if (use_zerocopy && send_buffer) reapZeroCopy(client_sock, true);
+
+    // With -g the first frames are sent whole while the background is
+    // learned, then only the foreground, after a refresh every bg_refresh frames
+    packParams params = {tf, num_of_threads, &background};
+    backgroundMode pass = BG_OFF;
+    int refresh_size = 0;
+    if (bg_learn)
     {
-        size = copyPointCloudXYZRGBToBuffer(pts, color, &buffer[0] + sizeof(short));
+        if (!background.size) initBackground(background, frame_capacity, &frame_arena);
+        pass = background.frames < bg_learn ? BG_LEARN : BG_FOREGROUND;
+        if (pass == BG_FOREGROUND && (background.frames - bg_learn) % bg_refresh == 0)
+        {
+            refresh_size = sendBackground(pts, depth, color, payload, params, lut, camera);
+            if (refresh_size < 0)
+                return -1;
+        }
+        background.frames++;
     }
+
+    size = packFrame(pts, depth, color, payload, params, lut, pass);
     
+    if (quality_fps)
+        size = applyQuality(payload, size, tf);
+
+    if (shm_name)
+        shmPublish(&shm_handle, size, quality_level);
+
     // Size in bytes of the payload
     size = 5 * size * sizeof(short);
     
-    if (send_buffer)
-    {   
-        // Include the number of bytes in the payload
-        memcpy(buffer, &size, sizeof(int));
-        send(client_sock, (char *)buffer, size + sizeof(int), 0);
+    if (shm_name)
+    {
+        tx_stats.frames++;
+        tx_stats.window_frames++;
+        tx_stats.bytes += size;
+        tx_stats.window_bytes += size;
+    }
+    else if (udp_address)
+    {
+        if (!sendFrameUDP(payload, size / (5 * sizeof(short))))
+            return -1;
+    }
+    else if (send_buffer)
+    {
+        // The frame header goes out from its slot, together with the payload
+        if (!sendFrame(client_sock, payload, size, camera, pass == BG_FOREGROUND ? FRAME_FOREGROUND : 0))
+            return -1;
+    }
+    size += refresh_size;
+
+    if (quality_fps)
+    {
+        // With several cameras the controller judges whole rounds, one frame of each
+        static double round_ms = 0;
+        static int round_bytes = 0;
+        round_ms += timeMilli(TIME_NOW - frame_start).count();
+        round_bytes += size;
+        if (camera == num_cameras - 1)
+        {
+            updateQuality(round_ms, round_bytes);
+            round_ms = 0;
+            round_bytes = 0;
+        }
     }
     
     return size;
@@ -8,6 +8,7 @@
 #include <cstring>
 #include <iostream>
 #include <chrono>
+#include <vector>
 
 #include <unistd.h>
 #include <stdio.h>
@@ -17,9 +18,9 @@
 
 #include <librealsense2/rs.hpp>
 
+#include "pcs-edge.h"
+
 #define TIME_NOW    std::chrono::high_resolution_clock::now()
-#define BUF_SIZE    4000000
-#define CONV_RATE   1000
 
 typedef std::chrono::high_resolution_clock clockTime;
 typedef std::chrono::duration<double, std::milli> timeMilli;
@@ -28,7 +29,7 @@ typedef std::chrono::time_point<clockTime> timestamp;
 char *filename = "samples.bag";
 timestamp time_start, time_end;
 
-void sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer);
+void sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, std::vector<short> &buffer);
 
 // Exit gracefully by closing all open sockets and freeing buffer
 void sigintHandler(int dummy) {
@@ -79,7 +80,7 @@ int main (int argc, char** argv) {
 
     int i = 0, last_frame = 0;
     double duration_sum = 0;
-    short *buffer = (short *)malloc(sizeof(short) * BUF_SIZE);
+    std::vector<short> buffer;
     
     rs2::frameset frames;
     
@@ -135,48 +136,15 @@ int main (int argc, char** argv) {
 }
 
 
-// Returns the RGB value of a point in the pointcloud.
-std::tuple<uint8_t, uint8_t, uint8_t> get_texcolor(rs2::video_frame texture, rs2::texture_coordinate texcoords) {
-    const int w = texture.get_width(), h = texture.get_height();
-    int x = std::min(std::max(int(texcoords.u*w + .5f), 0), w - 1);
-    int y = std::min(std::max(int(texcoords.v*h + .5f), 0), h - 1);
-    int idx = x * texture.get_bytes_per_pixel() + y * texture.get_stride_in_bytes();
-    const auto texture_data = reinterpret_cast<const uint8_t*>(texture.get_data());
-
-    return std::tuple<uint8_t, uint8_t, uint8_t>(texture_data[idx], texture_data[idx + 1], texture_data[idx + 2]);
-}
-
-// Converts the XYZ values into shorts for less memory overhead,
-// and puts the XYZRGB values of each point into the buffer.
-int copyPointCloudXYZRGBToBuffer(rs2::points& pts, const rs2::video_frame& color, short * pc_buffer) {
-
-    auto vertices = pts.get_vertices();
-    auto tex_coords = pts.get_texture_coordinates();
-    int size = 0;
-
-    for (size_t i = 0; i < pts.size() && (5 * size + 2) < BUF_SIZE; i++) {
-        // Set cutoff range for pixel points, to lower data size, and omit outlying points
-        //if ((vertices[i].x != 0) && (vertices[i].x < 2) && (vertices[i].x > -2) && (vertices[i].z != 0) && (vertices[i].z < .5)) {
-            std::tuple<uint8_t, uint8_t, uint8_t> current_color = get_texcolor(color, tex_coords[i]);
+void sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, std::vector<short> &buffer) {
+    // Room for the size header and five shorts per point
+    buffer.resize(2 + 5 * pts.size());
 
-            pc_buffer[size * 5 + 0] = static_cast<short>(vertices[i].x * CONV_RATE);
-            pc_buffer[size * 5 + 1] = static_cast<short>(vertices[i].y * CONV_RATE);
-            pc_buffer[size * 5 + 2] = static_cast<short>(vertices[i].z * CONV_RATE);
-            pc_buffer[size * 5 + 3] = (short)std::get<0>(current_color) + (short)(std::get<1>(current_color) << 8);
-            pc_buffer[size * 5 + 4] = std::get<2>(current_color);
-
-            size++;
-        //}
-    }
-
-    return size;
-}
-
-void sendXYZRGBPointcloud(rs2::points pts, rs2::video_frame color, short * buffer) {
     // Add size of buffer to beginning of message
-    int size = copyPointCloudXYZRGBToBuffer(pts, color, &buffer[0] + sizeof(short));
+    packParams params = {NULL, 1};
+    int size = packPoints<false, false>(makePackSource(pts, color), params, &buffer[0] + sizeof(short));
     size = 5 * size * sizeof(short);
-    memcpy(buffer, &size, sizeof(int));
+    memcpy(&buffer[0], &size, sizeof(int));
 
     //send(client_sock, (char *)buffer, size + sizeof(int), 0);
-}
\ No newline at end of file
+}
@@ -0,0 +1,534 @@
+/*
+ * pcs-edge.cpp
+ *
+ * Packing kernels and connection code of the edge servers, see pcs-edge.h.
+ * The kernels use SSE4.1 and FMA; this file is built with -mavx -mfma.
+ */
+
+#include "pcs-edge.h"
+
+#include <cstring>
+#include <cerrno>
+#include <iostream>
+#include <algorithm>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <omp.h>
+#include <immintrin.h>
+
+#define EDGE_MAX_THREADS    256
+
+static const uint8_t NO_COLOR[3] = {0, 0, 0};
+
+// Color of point i: at its gathered index, or at the same pixel of an
+// aligned frame.
+template <int Color>
+static inline const uint8_t *pointColor(const uint8_t *color, int bytes_per_pixel, int i, int idx) {
+    if (Color == COLOR_GATHER) return color + idx;
+    if (Color == COLOR_ALIGNED) return color + (size_t)i * bytes_per_pixel;
+    return NO_COLOR;
+}
+
+// Vector constants of the vertex kernels, built once per frame.
+struct packConsts {
+    __m128 m[3][3];             // Rotation scaled by EDGE_CONV_RATE
+    __m128 t[3];                // Translation, packed units
+    __m128 conv, half, w, h;
+    __m128 zero_f, z_max, x_min, x_max;
+    __m128 bg_step, bg_step_neg, bg_margin, bg_ratio;
+    __m128i zero, w_max, h_max, bpp, stride;
+    float sm[3][4];             // Scalar copy for the tail
+};
+
+static void initPackConsts(packConsts &c, const packSource &src, const packParams &params) {
+    const float *tf = params.tf;
+    for (int r = 0; r < 3; r++) {
+        for (int k = 0; k < 4; k++) c.sm[r][k] = (tf ? tf[r * 4 + k] : (r == k)) * EDGE_CONV_RATE;
+        for (int k = 0; k < 3; k++) c.m[r][k] = _mm_set1_ps(c.sm[r][k]);
+        c.t[r] = _mm_set1_ps(c.sm[r][3]);
+    }
+
+    c.conv = _mm_set1_ps(EDGE_CONV_RATE);
+    c.half = _mm_set1_ps(.5f);
+    c.w = _mm_set1_ps(float(src.width));
+    c.h = _mm_set1_ps(float(src.height));
+    c.zero_f = _mm_setzero_ps();
+    c.z_max = _mm_set1_ps(EDGE_CUTOFF_Z_MAX);
+    c.x_min = _mm_set1_ps(-EDGE_CUTOFF_X_MAX);
+    c.x_max = _mm_set1_ps(EDGE_CUTOFF_X_MAX);
+    if (params.background) {
+        c.bg_step = _mm_set1_ps(params.background->step);
+        c.bg_step_neg = _mm_set1_ps(-params.background->step);
+        c.bg_margin = _mm_set1_ps(params.background->margin);
+        c.bg_ratio = _mm_set1_ps(params.background->ratio);
+    }
+    c.zero = _mm_setzero_si128();
+    c.w_max = _mm_set1_epi32(src.width - 1);
+    c.h_max = _mm_set1_epi32(src.height - 1);
+    c.bpp = _mm_set1_epi32(src.bytes_per_pixel);
+    c.stride = _mm_set1_epi32(src.stride);
+}
+
+// Tests 4 pixels from i, at z meters, against the background and, unless
+// this is a refresh, moves the model towards them. Pixels without depth
+// are neither foreground nor background and leave the model alone. Returns
+// the mask of the points the pass keeps.
+template <int Background>
+static inline int backgroundMask(backgroundModel *model, const packConsts &c, int i, __m128 z) {
+    if (Background == BG_OFF) return 0xF;
+
+    float *plane = model->depth + i;
+    __m128 bg = _mm_load_ps(plane);
+    __m128 valid = _mm_cmpgt_ps(z, c.zero_f);
+    __m128 unknown = _mm_cmpeq_ps(bg, c.zero_f);
+
+    // Foreground: closer than the background by more than its noise, or where there is none yet
+    __m128 limit = _mm_fnmadd_ps(bg, c.bg_ratio, _mm_sub_ps(bg, c.bg_margin));
+    __m128 fg = _mm_and_ps(valid, _mm_or_ps(unknown, _mm_cmplt_ps(z, limit)));
+
+    if (Background != BG_BACKGROUND) {
+        // Step towards the depth, or take it on the first sight of the pixel
+        __m128 delta = _mm_min_ps(_mm_max_ps(_mm_sub_ps(z, bg), c.bg_step_neg), c.bg_step);
+        __m128 next = _mm_blendv_ps(_mm_add_ps(bg, delta), z, unknown);
+        _mm_store_ps(plane, _mm_blendv_ps(bg, next, valid));
+    }
+
+    if (Background == BG_FOREGROUND) return _mm_movemask_ps(fg);
+    if (Background == BG_BACKGROUND) return _mm_movemask_ps(_mm_andnot_ps(fg, valid));
+    return 0xF;
+}
+
+// Scalar backgroundMask of one pixel, for the tail.
+template <int Background>
+static inline bool backgroundKeep(backgroundModel *model, int i, float z) {
+    if (Background == BG_OFF) return true;
+
+    float &bg = model->depth[i];
+    bool valid = z > 0;
+    bool fg = valid && (bg == 0 || z < bg - model->margin - model->ratio * bg);
+
+    if (Background != BG_BACKGROUND && valid)
+        bg = bg == 0 ? z : bg + std::min(std::max(z - bg, -model->step), model->step);
+
+    if (Background == BG_FOREGROUND) return fg;
+    if (Background == BG_BACKGROUND) return valid && !fg;
+    return true;
+}
+
+// Splits the points into one contiguous block per thread, a multiple of 4
+// long. Each block packs into its own place in out, then the gaps left by
+// the cutoff are closed in block order, so the points keep their frame
+// order without a shared counter.
+template <class Range>
+static int packBlocks(int n, int threads, int shorts, short *out, bool compact, Range pack_range) {
+    int kept[EDGE_MAX_THREADS];
+    int team = 1, block = n;
+
+    #pragma omp parallel num_threads(std::min(std::max(threads, 1), EDGE_MAX_THREADS))
+    {
+        #pragma omp single
+        {
+            team = omp_get_num_threads();
+            block = ((n + team - 1) / team + 3) & ~3;
+        }
+
+        int t = omp_get_thread_num();
+        int begin = std::min(n, t * block), end = std::min(n, begin + block);
+        kept[t] = pack_range(begin, end, out + (size_t)begin * shorts);
+    }
+
+    if (!compact) return n;
+
+    int count = kept[0];
+    for (int t = 1; t < team; t++) {
+        int begin = std::min(n, t * block);
+        if (kept[t] && count != begin)
+            memmove(out + (size_t)count * shorts, out + (size_t)begin * shorts, (size_t)kept[t] * shorts * sizeof(short));
+        count += kept[t];
+    }
+    return count;
+}
+
+// Whether a kernel drops points, so its blocks need compacting
+template <bool Cutoff, int Background>
+struct packDrops {
+    static const bool value = Cutoff || Background == BG_FOREGROUND || Background == BG_BACKGROUND;
+};
+
+template <bool Cutoff, bool Transform, int Color, int Background, class Format>
+static int packRange(const packSource &src, const packConsts &c, backgroundModel *model,
+                     int begin, int end, short *out) {
+    const bool drops = packDrops<Cutoff, Background>::value;
+    int count = 0;
+    int i = begin;
+
+    for (; i + 4 <= end; i += 4) {
+        const rs2::vertex *v = &src.vertices[i];
+        __attribute__((aligned(16))) int px[4], py[4], pz[4], idx[4];
+
+        __m128 x = _mm_set_ps(v[3].x, v[2].x, v[1].x, v[0].x);
+        __m128 y = _mm_set_ps(v[3].y, v[2].y, v[1].y, v[0].y);
+        __m128 z = _mm_set_ps(v[3].z, v[2].z, v[1].z, v[0].z);
+
+        if (Color == COLOR_GATHER) {
+            // Color pixel of each point, clamped to the image
+            const rs2::texture_coordinate *tc = &src.texcoords[i];
+            __m128 u = _mm_set_ps(tc[3].u, tc[2].u, tc[1].u, tc[0].u);
+            __m128 w = _mm_set_ps(tc[3].v, tc[2].v, tc[1].v, tc[0].v);
+            __m128i ui = _mm_cvttps_epi32(_mm_fmadd_ps(u, c.w, c.half));
+            __m128i vi = _mm_cvttps_epi32(_mm_fmadd_ps(w, c.h, c.half));
+            ui = _mm_min_epi32(_mm_max_epi32(ui, c.zero), c.w_max);
+            vi = _mm_min_epi32(_mm_max_epi32(vi, c.zero), c.h_max);
+            _mm_store_si128((__m128i *)idx, _mm_add_epi32(_mm_mullo_epi32(ui, c.bpp), _mm_mullo_epi32(vi, c.stride)));
+        }
+
+        __m128 ox, oy, oz;
+        if (Transform) {
+            ox = _mm_fmadd_ps(z, c.m[0][2], _mm_fmadd_ps(y, c.m[0][1], _mm_fmadd_ps(x, c.m[0][0], c.t[0])));
+            oy = _mm_fmadd_ps(z, c.m[1][2], _mm_fmadd_ps(y, c.m[1][1], _mm_fmadd_ps(x, c.m[1][0], c.t[1])));
+            oz = _mm_fmadd_ps(z, c.m[2][2], _mm_fmadd_ps(y, c.m[2][1], _mm_fmadd_ps(x, c.m[2][0], c.t[2])));
+        }
+        else {
+            ox = _mm_mul_ps(x, c.conv);
+            oy = _mm_mul_ps(y, c.conv);
+            oz = _mm_mul_ps(z, c.conv);
+        }
+        _mm_store_si128((__m128i *)px, _mm_cvttps_epi32(ox));
+        _mm_store_si128((__m128i *)py, _mm_cvttps_epi32(oy));
+        _mm_store_si128((__m128i *)pz, _mm_cvttps_epi32(oz));
+
+        int mask = 0xF;
+        if (Cutoff) {
+            // Box in the camera frame
+            __m128 z_mask = _mm_and_ps(_mm_cmpgt_ps(z, c.zero_f), _mm_cmple_ps(z, c.z_max));
+            __m128 x_mask = _mm_and_ps(_mm_cmpgt_ps(x, c.x_min), _mm_cmple_ps(x, c.x_max));
+            mask = _mm_movemask_ps(_mm_and_ps(z_mask, x_mask));
+        }
+        mask &= backgroundMask<Background>(model, c, i, z);
+
+        for (int k = 0; k < 4; k++) {
+            if (drops && !(mask & (1 << k))) continue;
+            Format::store(out + count * Format::SHORTS, px[k], py[k], pz[k],
+                          pointColor<Color>(src.color, src.bytes_per_pixel, i + k, idx[k]));
+            count++;
+        }
+    }
+
+    // Last points of a frame that is not a multiple of 4
+    for (; i < end; i++) {
+        const rs2::vertex &v = src.vertices[i];
+        bool inside = !Cutoff || (v.z > 0 && v.z <= EDGE_CUTOFF_Z_MAX && v.x > -EDGE_CUTOFF_X_MAX && v.x <= EDGE_CUTOFF_X_MAX);
+        if (!backgroundKeep<Background>(model, i, v.z) || !inside)
+            continue;
+
+        int idx = 0;
+        if (Color == COLOR_GATHER) {
+            int u = std::min(std::max(int(src.texcoords[i].u * src.width + .5f), 0), src.width - 1);
+            int w = std::min(std::max(int(src.texcoords[i].v * src.height + .5f), 0), src.height - 1);
+            idx = u * src.bytes_per_pixel + w * src.stride;
+        }
+        const uint8_t *rgb = pointColor<Color>(src.color, src.bytes_per_pixel, i, idx);
+
+        float p[3];
+        for (int r = 0; r < 3; r++)
+            p[r] = Transform ? c.sm[r][0] * v.x + c.sm[r][1] * v.y + c.sm[r][2] * v.z + c.sm[r][3]
+                             : (&v.x)[r] * EDGE_CONV_RATE;
+        Format::store(out + count * Format::SHORTS, int(p[0]), int(p[1]), int(p[2]), rgb);
+        count++;
+    }
+
+    return count;
+}
+
+packSource makePackSource(const rs2::points &pts, const rs2::video_frame &color) {
+    packSource src;
+    src.vertices = pts.get_vertices();
+    src.texcoords = pts.get_texture_coordinates();
+    src.num_points = pts.size();
+    src.color = reinterpret_cast<const uint8_t *>(color.get_data());
+    src.width = color.get_width();
+    src.height = color.get_height();
+    src.bytes_per_pixel = color.get_bytes_per_pixel();
+    src.stride = color.get_stride_in_bytes();
+    return src;
+}
+
+template <bool Cutoff, bool Transform, int Color, int Background, class Format>
+int packPoints(const packSource &src, const packParams &params, short *out) {
+    packConsts c;
+    initPackConsts(c, src, params);
+
+    return packBlocks(src.num_points, params.threads, Format::SHORTS, out, packDrops<Cutoff, Background>::value,
+                      [&](int begin, int end, short *dst) {
+                          return packRange<Cutoff, Transform, Color, Background, Format>(src, c, params.background,
+                                                                                         begin, end, dst);
+                      });
+}
+
+// One background mode of the kernel tables, [cutoff][transform][color]
+#define PACK_COLORS(cutoff, transform, bg) \
+    {packPoints<cutoff, transform, COLOR_NONE, bg>, packPoints<cutoff, transform, COLOR_GATHER, bg>, \
+     packPoints<cutoff, transform, COLOR_ALIGNED, bg>}
+#define PACK_MODE(bg) \
+    {{PACK_COLORS(false, false, bg), PACK_COLORS(false, true, bg)}, \
+     {PACK_COLORS(true, false, bg), PACK_COLORS(true, true, bg)}}
+
+// [background][cutoff][transform][color]
+static const packKernel PACK_KERNELS[4][2][2][3] = {
+    PACK_MODE(BG_OFF), PACK_MODE(BG_LEARN), PACK_MODE(BG_FOREGROUND), PACK_MODE(BG_BACKGROUND),
+};
+
+packKernel selectPackKernel(bool cutoff, bool transform, colorMode color, backgroundMode background) {
+    return PACK_KERNELS[background][cutoff][transform][color];
+}
+
+static size_t lutPlaneBytes(int points) {
+    // Round up so every plane starts on a cache line and SIMD loads never straddle the end
+    return ((points * sizeof(float) + 63) / 64) * 64;
+}
+
+static float *allocLUT(frameArena *arena, int points) {
+    size_t bytes = lutPlaneBytes(points);
+    float *plane = arena ? (float *)arenaAlloc(arena, bytes) : NULL;
+    return plane ? plane : (float *)aligned_alloc(64, bytes);
+}
+
+size_t rayLUTBytes(int points) {
+    return 7 * lutPlaneBytes(points);
+}
+
+size_t backgroundBytes(int points) {
+    return lutPlaneBytes(points);
+}
+
+void initBackground(backgroundModel &model, int points, frameArena *arena) {
+    model.size = points;
+    model.depth = allocLUT(arena, points);
+    model.step = EDGE_BG_STEP;
+    model.margin = EDGE_BG_MARGIN;
+    model.ratio = EDGE_BG_RATIO;
+    resetBackground(model);
+}
+
+void resetBackground(backgroundModel &model) {
+    memset(model.depth, 0, lutPlaneBytes(model.size));
+    model.frames = 0;
+}
+
+// rs2_deproject_pixel_to_point undoes the Brown-Conrady (or inverse
+// Brown-Conrady) distortion of the depth intrinsics, so the tables are
+// exact for the stream they were built from.
+void initRayLUT(rayLUT &lut, const rs2::depth_frame &depth, const rs2::video_frame &color,
+                const float *tf, frameArena *arena, int threads) {
+    rs2_intrinsics depth_intr = depth.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+    lut.color_intr = color.get_profile().as<rs2::video_stream_profile>().get_intrinsics();
+    lut.depth_to_color = depth.get_profile().get_extrinsics_to(color.get_profile());
+
+    lut.size = depth_intr.width * depth_intr.height;
+    lut.units = depth.get_units();
+
+    lut.ray_x = allocLUT(arena, lut.size);
+    lut.ray_y = allocLUT(arena, lut.size);
+    lut.ray_z = allocLUT(arena, lut.size);
+    lut.ray_cx = allocLUT(arena, lut.size);
+    lut.color_x = allocLUT(arena, lut.size);
+    lut.color_y = allocLUT(arena, lut.size);
+    lut.color_z = allocLUT(arena, lut.size);
+
+    const float scale = lut.units * EDGE_CONV_RATE;
+    const float *rot = lut.depth_to_color.rotation;     // column-major
+
+    #pragma omp parallel for schedule(static) num_threads(std::max(threads, 1))
+    for (int v = 0; v < depth_intr.height; v++) {
+        for (int u = 0; u < depth_intr.width; u++) {
+            int i = v * depth_intr.width + u;
+            float pixel[2] = {float(u), float(v)};
+            float ray[3];
+            rs2_deproject_pixel_to_point(ray, &depth_intr, pixel, 1.f);
+
+            lut.ray_x[i] = (tf[0] * ray[0] + tf[1] * ray[1] + tf[2]  * ray[2]) * scale;
+            lut.ray_y[i] = (tf[4] * ray[0] + tf[5] * ray[1] + tf[6]  * ray[2]) * scale;
+            lut.ray_z[i] = (tf[8] * ray[0] + tf[9] * ray[1] + tf[10] * ray[2]) * scale;
+            lut.ray_cx[i] = ray[0] * lut.units;
+
+            lut.color_x[i] = (rot[0] * ray[0] + rot[3] * ray[1] + rot[6] * ray[2]) * lut.units;
+            lut.color_y[i] = (rot[1] * ray[0] + rot[4] * ray[1] + rot[7] * ray[2]) * lut.units;
+            lut.color_z[i] = (rot[2] * ray[0] + rot[5] * ray[1] + rot[8] * ray[2]) * lut.units;
+        }
+    }
+
+    lut.t[0] = tf[3] * EDGE_CONV_RATE;
+    lut.t[1] = tf[7] * EDGE_CONV_RATE;
+    lut.t[2] = tf[11] * EDGE_CONV_RATE;
+
+    std::cout << "Ray LUT: " << depth_intr.width << " x " << depth_intr.height \
+        << " (" << 7 * float(lut.size * sizeof(float)) / (1<<20) << " MBytes)" << std::endl;
+}
+
+template <bool Cutoff, int Color, int Background, class Format>
+static int packLUTRange(const rayLUT &lut, const uint16_t *depth_data, const packSource &color,
+                        const packConsts &c, backgroundModel *model, int begin, int end, short *out) {
+    const bool drops = packDrops<Cutoff, Background>::value;
+    const __m128 t_x = _mm_set1_ps(lut.t[0]), t_y = _mm_set1_ps(lut.t[1]), t_z = _mm_set1_ps(lut.t[2]);
+    const __m128 dc_x = _mm_set1_ps(lut.depth_to_color.translation[0]);
+    const __m128 dc_y = _mm_set1_ps(lut.depth_to_color.translation[1]);
+    const __m128 dc_z = _mm_set1_ps(lut.depth_to_color.translation[2]);
+    const __m128 fx = _mm_set1_ps(lut.color_intr.fx), fy = _mm_set1_ps(lut.color_intr.fy);
+    const __m128 ppx = _mm_set1_ps(lut.color_intr.ppx), ppy = _mm_set1_ps(lut.color_intr.ppy);
+    const __m128 units = _mm_set1_ps(lut.units), one = _mm_set1_ps(1.f);
+    int count = 0;
+
+    for (int i = begin; i + 4 <= end; i += 4) {
+        __attribute__((aligned(16))) int px[4], py[4], pz[4], idx[4];
+
+        // Widen 4 depth values to floats
+        __m128i zi = _mm_cvtepu16_epi32(_mm_loadl_epi64((const __m128i *)&depth_data[i]));
+        __m128 z = _mm_cvtepi32_ps(zi);
+
+        // Transformed point = z * ray + t
+        _mm_store_si128((__m128i *)px, _mm_cvttps_epi32(_mm_fmadd_ps(z, _mm_load_ps(&lut.ray_x[i]), t_x)));
+        _mm_store_si128((__m128i *)py, _mm_cvttps_epi32(_mm_fmadd_ps(z, _mm_load_ps(&lut.ray_y[i]), t_y)));
+        _mm_store_si128((__m128i *)pz, _mm_cvttps_epi32(_mm_fmadd_ps(z, _mm_load_ps(&lut.ray_z[i]), t_z)));
+
+        if (Color == COLOR_GATHER) {
+            // Finish the depth-to-color projection
+            __m128 cx = _mm_fmadd_ps(z, _mm_load_ps(&lut.color_x[i]), dc_x);
+            __m128 cy = _mm_fmadd_ps(z, _mm_load_ps(&lut.color_y[i]), dc_y);
+            __m128 cz = _mm_fmadd_ps(z, _mm_load_ps(&lut.color_z[i]), dc_z);
+            __m128 inv_cz = _mm_div_ps(one, cz);
+
+            __m128i ui = _mm_cvttps_epi32(_mm_fmadd_ps(_mm_mul_ps(cx, inv_cz), fx, ppx));
+            __m128i vi = _mm_cvttps_epi32(_mm_fmadd_ps(_mm_mul_ps(cy, inv_cz), fy, ppy));
+            ui = _mm_min_epi32(_mm_max_epi32(ui, c.zero), c.w_max);
+            vi = _mm_min_epi32(_mm_max_epi32(vi, c.zero), c.h_max);
+            _mm_store_si128((__m128i *)idx, _mm_add_epi32(_mm_mullo_epi32(ui, c.bpp), _mm_mullo_epi32(vi, c.stride)));
+        }
+
+        int mask = 0xF;
+        __m128 z_m = _mm_mul_ps(z, units);
+        if (Cutoff) {
+            // Same box as the vertex kernels, evaluated in the camera frame
+            __m128 x_m = _mm_mul_ps(z, _mm_load_ps(&lut.ray_cx[i]));
+
+            __m128 z_mask = _mm_and_ps(_mm_cmpgt_ps(z_m, c.zero_f), _mm_cmple_ps(z_m, c.z_max));
+            __m128 x_mask = _mm_and_ps(_mm_cmpgt_ps(x_m, c.x_min), _mm_cmple_ps(x_m, c.x_max));
+            mask = _mm_movemask_ps(_mm_and_ps(z_mask, x_mask));
+        }
+        mask &= backgroundMask<Background>(model, c, i, z_m);
+
+        for (int k = 0; k < 4; k++) {
+            if (drops && !(mask & (1 << k))) continue;
+            Format::store(out + count * Format::SHORTS, px[k], py[k], pz[k],
+                          pointColor<Color>(color.color, color.bytes_per_pixel, i + k, idx[k]));
+            count++;
+        }
+    }
+
+    return count;
+}
+
+template <bool Cutoff, int Color, int Background, class Format>
+int packDepthLUT(const rayLUT &lut, const rs2::depth_frame &depth, const rs2::video_frame &color,
+                 const packParams &params, short *out) {
+    const uint16_t *depth_data = reinterpret_cast<const uint16_t *>(depth.get_data());
+    packSource src = {NULL, NULL, 0, reinterpret_cast<const uint8_t *>(color.get_data()),
+                      color.get_width(), color.get_height(), color.get_bytes_per_pixel(), color.get_stride_in_bytes()};
+    packConsts c;
+    initPackConsts(c, src, params);
+
+    // The tables cover whole groups of 4 pixels
+    return packBlocks(lut.size & ~3, params.threads, Format::SHORTS, out, packDrops<Cutoff, Background>::value,
+                      [&](int begin, int end, short *dst) {
+                          return packLUTRange<Cutoff, Color, Background, Format>(lut, depth_data, src, c, params.background,
+                                                                                 begin, end, dst);
+                      });
+}
+
+#define LUT_COLORS(cutoff, bg) \
+    {packDepthLUT<cutoff, COLOR_NONE, bg>, packDepthLUT<cutoff, COLOR_GATHER, bg>, packDepthLUT<cutoff, COLOR_ALIGNED, bg>}
+#define LUT_MODE(bg) {LUT_COLORS(false, bg), LUT_COLORS(true, bg)}
+
+// [background][cutoff][color]
+static const lutKernel LUT_KERNELS[4][2][3] = {
+    LUT_MODE(BG_OFF), LUT_MODE(BG_LEARN), LUT_MODE(BG_FOREGROUND), LUT_MODE(BG_BACKGROUND),
+};
+
+lutKernel selectLUTKernel(bool cutoff, colorMode color, backgroundMode background) {
+    return LUT_KERNELS[background][cutoff][color];
+}
+
+void fillStreamHeader(streamHeader &header, const rs2::pipeline_profile &selection) {
+    auto depth_stream = selection.get_stream(RS2_STREAM_DEPTH).as<rs2::video_stream_profile>();
+    header.magic = STREAM_MAGIC;
+    header.version = STREAM_VERSION;
+    header.max_points = depth_stream.width() * depth_stream.height();
+    header.width = depth_stream.width();
+    header.height = depth_stream.height();
+    header.fps = depth_stream.fps();
+    header.cameras = 1;
+}
+
+int acceptCentral(int port, const streamHeader &header, int *listen_sock) {
+    struct sockaddr_in serv_addr;
+    memset(&serv_addr, 0, sizeof(serv_addr));
+    serv_addr.sin_family = AF_INET;
+    serv_addr.sin_addr.s_addr = INADDR_ANY;
+    serv_addr.sin_port = htons(port);
+
+    int sockfd = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+    if (sockfd < 0) {
+        std::cerr << "\nSocket fd not received." << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    // reuse SOCKET AND ADDRESS/PORT
+    int opt = 1;
+    if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt))) perror("setsockopt failed");
+
+    if (bind(sockfd, (struct sockaddr *) &serv_addr, sizeof(serv_addr)) < 0) {
+        std::cerr << "\nBind failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen(sockfd, 3) < 0) {
+        std::cerr << "\nListen failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Waiting for client..." << std::endl;
+
+    int client_sock = accept(sockfd, NULL, NULL);
+    if (client_sock < 0) {
+        std::cerr << "\nConnection failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Established connection with client_sock: " << client_sock << std::endl;
+
+    // Announce the frame capacity so the receiver can size its buffers
+    if (!sendNBytes(client_sock, (const char *)&header, sizeof(header))) {
+        std::cerr << "\nStream handshake failed" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
+    if (listen_sock) *listen_sock = sockfd;
+    return client_sock;
+}
+
+bool sendNBytes(int sock, const char *data, size_t n) {
+    size_t total_bytes = 0;
+
+    while (total_bytes < n) {
+        ssize_t bytes_sent = send(sock, data + total_bytes, n - total_bytes, MSG_NOSIGNAL);
+        if (bytes_sent < 0) {
+            if (errno == EINTR) continue;
+            return false;
+        }
+        total_bytes += bytes_sent;
+    }
+
+    return true;
+}
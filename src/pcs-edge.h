@@ -0,0 +1,178 @@
+/*
+ * pcs-edge.h
+ *
+ * Packing engine shared by the edge servers (pcs-camera-optimized,
+ * pcs-camera-server and pcs-camera-test-samples). A kernel turns one frame
+ * into packed points; cutoff, transform, color and point format are
+ * template parameters, so each combination is compiled without per-point
+ * branches, and the callers pick one from a table once per frame.
+ * The kernels live in the pcs-edge library, built with -mavx -mfma, so an
+ * optimization lands in every executable at once.
+ *
+ * Two sources are supported: the vertices and texture coordinates computed
+ * by rs2::pointcloud, and the raw depth frame deprojected through a
+ * per-pixel ray LUT. Both keep the points in frame order, also when the
+ * cutoff drops some of them.
+ *
+ * Either kernel can also remove the static background in the same pass,
+ * against a per-pixel background depth model it keeps up to date.
+ *
+ * Also shared: the connection to the central computer, which starts with
+ * the stream handshake, and sendNBytes.
+ */
+
+#ifndef PCS_EDGE_H
+#define PCS_EDGE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+#include <librealsense2/rs.hpp>
+#include <librealsense2/rsutil.h>
+
+#include "pcs-protocol.h"
+#include "pcs-arena.h"
+
+#define EDGE_CONV_RATE      1000.0f     // Packed units (millimeters) per meter
+#define EDGE_CUTOFF_Z_MAX   1.5f        // Cutoff box in the camera frame, meters
+#define EDGE_CUTOFF_X_MAX   2.0f
+#define EDGE_BG_STEP        0.001f      // Meters a background pixel moves per frame
+#define EDGE_BG_MARGIN      0.03f       // Foreground margin in front of the background, meters
+#define EDGE_BG_RATIO       0.02f       // Plus this share of the background depth, for the depth noise
+
+// Wire format of the packed points: x, y, z in millimeters, then the color
+// as rg and b shorts.
+struct formatXYZRGB {
+    static const int SHORTS = 5;
+
+    static inline void store(short *dst, int x, int y, int z, const uint8_t *rgb) {
+        dst[0] = short(x);
+        dst[1] = short(y);
+        dst[2] = short(z);
+        dst[3] = rgb[0] + (rgb[1] << 8);
+        dst[4] = rgb[2];
+    }
+};
+
+// Where a kernel takes the color of a point from.
+enum colorMode {
+    COLOR_NONE,         // Color fields are zero
+    COLOR_GATHER,       // Looked up per point in the color frame
+    COLOR_ALIGNED,      // Color frame resampled to depth by rs2::align, read in lockstep
+};
+
+// Colored vertices of one frame, as computed by rs2::pointcloud. With
+// COLOR_ALIGNED the color frame has the depth geometry and is tightly
+// packed, as rs2::align outputs it, so point i has pixel i.
+struct packSource {
+    const rs2::vertex *vertices;
+    const rs2::texture_coordinate *texcoords;
+    int num_points;
+    const uint8_t *color;
+    int width;
+    int height;
+    int bytes_per_pixel;
+    int stride;
+};
+
+packSource makePackSource(const rs2::points &pts, const rs2::video_frame &color);
+
+// Background depth of one camera, in meters, one float per depth pixel in
+// a 64-byte aligned plane; 0 until the pixel has seen depth. Every frame
+// moves each pixel towards its depth by at most step, so the model follows
+// the running median of the pixel, and objects that stay put become
+// background.
+struct backgroundModel {
+    int size = 0;
+    float *depth;
+    float step;                 // Meters per frame
+    float margin;               // A point is foreground if closer than
+    float ratio;                // depth - margin - ratio * depth
+    long frames = 0;            // Frames the model has seen, kept by the caller
+};
+
+// Bytes of arena the model of a stream with the given number of pixels takes.
+size_t backgroundBytes(int points);
+
+// Starts an empty model with the default step and margins. The plane comes
+// from the arena when it has room.
+void initBackground(backgroundModel &model, int points, frameArena *arena);
+
+// Forgets what the model learned, so it starts over like a new one.
+void resetBackground(backgroundModel &model);
+
+// What a kernel does with the background model.
+enum backgroundMode {
+    BG_OFF,             // No model
+    BG_LEARN,           // Every point is kept, the model is updated
+    BG_FOREGROUND,      // Points in front of the background are kept, the model is updated
+    BG_BACKGROUND,      // The other points are kept, for a background refresh
+};
+
+struct packParams {
+    const float *tf;            // Row-major 4x4 camera transform, used by Transform kernels
+    int threads;                // OpenMP threads
+    backgroundModel *background;    // Used by all but BG_OFF kernels
+};
+
+// Packs the frame into out and returns the number of points written. With
+// Cutoff only points inside the cutoff box are kept; with Transform the
+// points are moved into the global frame. Only COLOR_GATHER reads the
+// texture coordinates. Background passes point i against pixel i of the
+// model, as the points of rs2::pointcloud are in depth pixel order.
+template <bool Cutoff, bool Transform, int Color = COLOR_GATHER, int Background = BG_OFF, class Format = formatXYZRGB>
+int packPoints(const packSource &src, const packParams &params, short *out);
+
+// Every instantiation of the wire format, indexed by its flags, so the
+// kernel is picked once per frame instead of tested per point.
+typedef int (*packKernel)(const packSource &src, const packParams &params, short *out);
+
+packKernel selectPackKernel(bool cutoff, bool transform, colorMode color, backgroundMode background = BG_OFF);
+
+// Per-pixel ray tables of a depth stream, one 64-byte aligned plane per
+// coordinate. ray_* holds R * ray(u,v) scaled by the depth units and
+// EDGE_CONV_RATE, so a transformed coordinate is a single z16 * ray + t FMA.
+struct rayLUT {
+    int size = 0;
+    float units;
+    float *ray_x, *ray_y, *ray_z;
+    float *ray_cx;                          // Untransformed x/z of the ray, for the cutoff
+    float *color_x, *color_y, *color_z;     // Ray in the color camera frame, in depth units
+    float t[3];                             // Translation, packed units
+    rs2_intrinsics color_intr;
+    rs2_extrinsics depth_to_color;
+};
+
+// Bytes of arena the tables of a stream with the given number of pixels take.
+size_t rayLUTBytes(int points);
+
+// Deprojects every depth pixel once for the session, with the transform
+// folded in. The planes come from the arena when it has room.
+void initRayLUT(rayLUT &lut, const rs2::depth_frame &depth, const rs2::video_frame &color,
+                const float *tf, frameArena *arena, int threads);
+
+// Deprojects the raw Z16 depth frame through the tables, skipping
+// pc.calculate(). Color is looked up by finishing the depth-to-color
+// projection per point, unless the color frame is aligned to depth.
+template <bool Cutoff, int Color = COLOR_GATHER, int Background = BG_OFF, class Format = formatXYZRGB>
+int packDepthLUT(const rayLUT &lut, const rs2::depth_frame &depth, const rs2::video_frame &color,
+                 const packParams &params, short *out);
+
+typedef int (*lutKernel)(const rayLUT &lut, const rs2::depth_frame &depth, const rs2::video_frame &color,
+                         const packParams &params, short *out);
+
+lutKernel selectLUTKernel(bool cutoff, colorMode color, backgroundMode background = BG_OFF);
+
+// Fills the handshake from the depth stream of the started pipeline.
+void fillStreamHeader(streamHeader &header, const rs2::pipeline_profile &selection);
+
+// Listens on the port, accepts the central computer and sends it the
+// stream handshake. Returns the connected socket and stores the listening
+// one in *listen_sock. Exits on failure.
+int acceptCentral(int port, const streamHeader &header, int *listen_sock);
+
+// Writes n bytes, continuing after partial sends. Returns false if the
+// peer is gone.
+bool sendNBytes(int sock, const char *data, size_t n);
+
+#endif
@@ -11,7 +11,9 @@
 
 #include <librealsense2/rs.hpp>
 #include <pcl/point_cloud.h>
+#ifndef PCS_HEADLESS
 #include <pcl/visualization/pcl_visualizer.h>
+#endif
 #include <pcl/common/transforms.h>
 #include <pcl/io/ply_io.h>
 #include <pcl/filters/voxel_grid.h>
@@ -19,10 +21,12 @@
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/mman.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
 #include <unistd.h>
+#include <errno.h>
 #include <stdio.h>
 #include <cstring>
 #include <iostream>
@@ -30,6 +34,24 @@
 #include <signal.h>
 #include <chrono>
 #include <thread>
+#include <vector>
+#include <deque>
+#include <atomic>
+#include <cmath>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <zlib.h>
+#include <omp.h>
+
+#include "pcs-calibration.h"
+#include "pcs-protocol.h"
+#include "pcs-affinity.h"
+#include "pcs-stitch.h"
 
 typedef pcl::PointCloud<pcl::PointXYZ> pointCloudXYZ;
 typedef pcl::PointCloud<pcl::PointXYZRGB> pointCloudXYZRGB;
@@ -37,17 +59,31 @@ typedef std::chrono::high_resolution_clock clockTime;
 typedef std::chrono::time_point<clockTime> timePoint;
 typedef std::chrono::duration<double, std::milli> timeMilli;
 
-const int NUM_CAMERAS = 2;
+const int MAX_CAMERAS = 4;         // Largest camera set, such as one edge box driving four
 
 // const int CLIENT_PORT = 8000;
 const int SERVER_PORT = 8000;
-const int BUF_SIZE = 5000000;
 const int STITCHED_BUF_SIZE = 32000000;
 const float CONV_RATE = 1000.0;
-const char PULL_XYZ = 'Y';
-const char PULL_XYZRGB = 'Z';
-
-const std::string IP_ADDRESS[NUM_CAMERAS] = {"192.168.2.8", "192.168.2.9"};
+const int FUSION_BITS = 21;         // 2M voxel slots
+const int FUSION_MAX_PROBE = 64;
+const int DEDUP_SHARD_BITS = 6;
+const int DEDUP_SHARDS = 1 << DEDUP_SHARD_BITS;
+const int LOD_LEVELS = 6;                  // Full cloud plus five voxel levels
+const float LOD_BASE_VOXEL = 0.005;        // Voxel size of level 1, doubling per level
+const int LOD_DEFAULT_BUDGET = 1000000;    // Points handed to the viewer
+const int PUBLISH_QUEUE_DEPTH = 2;         // Frames queued per subscriber before the oldest is dropped
+const float SPATIAL_CELL = 0.05;           // Cell size of the spatial query index
+const int REFINE_REFERENCE_CAMERA = 1;     // Camera 1 is the global frame
+const int REFINE_ITERATIONS = 15;
+const int REFINE_MIN_MATCHES = 200;
+const int REFINE_MIN_VOXEL_POINTS = 5;
+const float REFINE_MAX_SHIFT = 0.05;       // Larger corrections are not mount drift
+const float REFINE_MAX_ANGLE = 0.035;      // ~2 degrees
+
+const std::string IP_ADDRESS[] = {"192.168.2.8", "192.168.2.9"};
+
+int num_cameras = 2;                    // One per IP_ADDRESS; with -E, what the edge server streams
 
 int loop_count = 1;
 bool clean = true;
@@ -55,24 +91,120 @@ bool fast = false;
 bool timer = false;
 bool save = false;
 bool visual = false;
+bool udp = false;
+std::string udp_group;
+std::string edge_node;                  // One edge server drives every camera (-E)
+bool foreground_only = false;           // Leave out the edge servers' background refreshes (-G)
 int downsample = 1;
-int framecount = 0;
 int server_sockfd = 0;
 int client_sockfd = 0;
-int sockfd_array[NUM_CAMERAS];
-int socket_array[NUM_CAMERAS];
+std::string shm_name[MAX_CAMERAS];     // Cameras read from a local shared-memory ring
+int camera_quality[MAX_CAMERAS];        // Last quality level signaled by each camera
+int numa_node[MAX_CAMERAS];             // Node of each camera's receive buffer, -1 for default
+bool lock_memory = false;
 short *stitched_buf;
-Eigen::Matrix4f transform[NUM_CAMERAS];
-std::thread *pcs_thread[NUM_CAMERAS];
+Eigen::Matrix4f transform[MAX_CAMERAS];
+std::unique_ptr<pcs::Stitcher> stitcher;   // Receives, transforms and merges the camera clouds
+
+struct fusionVoxel;
+bool fusion = false;
+float fusion_voxel_size = 0.01;
+int fusion_window = 1;
+int fusion_bits = FUSION_BITS;
+fusionVoxel *fusion_map;
+uint32_t fusion_frame = 1;
+std::atomic<long> fusion_voxels(0);
+std::atomic<long> fusion_dropped(0);
+std::vector<uint32_t> fusion_touched[MAX_CAMERAS];
+std::deque<std::vector<uint32_t>> fusion_history;
+
+bool dedup = false;
+float dedup_radius = 0.005;
+
+// Level of detail pyramid of the stitched cloud. Level 0 is the full cloud,
+// level k keeps one point per voxel of LOD_BASE_VOXEL * 2^(k-1).
+pointCloudXYZRGB::Ptr lod_levels[LOD_LEVELS];
+int lod_built = 0;                      // Levels of lod_levels built for the current frame
+int lod_budget = LOD_DEFAULT_BUDGET;
+
+// Publishing server (-P). Every subscriber has its own queue and sender
+// thread; a subscriber that falls behind loses its oldest frames.
+struct subscriber
+{
+    int sockfd;
+    subscribeRequest request;
+    std::deque<std::shared_ptr<const std::vector<char>>> queue;
+    std::mutex mutex;
+    std::condition_variable cv;
+    bool alive = true;
+    long sent = 0;
+    long dropped = 0;
+};
+
+// Frame handed from the stitching thread to the publisher thread, which
+// does the encoding. Holding the clouds makes the stitcher and the pyramid
+// allocate fresh ones rather than overwrite them.
+struct publishJob
+{
+    uint32_t frame_id;
+    std::vector<std::shared_ptr<subscriber>> subscribers;
+    std::map<int, pointCloudXYZRGB::Ptr> levels;    // By requested LOD
+};
+
+int publish_port = 0;
+uint32_t publish_frame = 0;
+std::vector<std::shared_ptr<subscriber>> subscribers;
+std::mutex subscribers_mutex;
+std::unique_ptr<publishJob> publish_job;    // Latest frame the publisher has not taken yet
+std::mutex publish_mutex;
+std::condition_variable publish_cv;
+long publish_skipped = 0;                   // Frames replaced before the publisher took them
+
+// Spatial index over the latest stitched frame (-Q). Points are stored
+// ordered by grid cell; each cell maps to its range of points. The cells
+// are split into shards by hash, so the index is built in parallel.
+struct spatialIndex
+{
+    std::vector<pcl::PointXYZRGB, Eigen::aligned_allocator<pcl::PointXYZRGB>> points;
+    std::unordered_map<uint64_t, std::pair<uint32_t, uint32_t>> cells[DEDUP_SHARDS];   // First point, count
+    int64_t min_cell[3];
+    int64_t max_cell[3];
+    uint32_t frame_id;
+    double build_ms;
+};
+
+int query_port = 0;
+uint32_t index_frame = 0;
+double index_total_ms = 0;
+std::shared_ptr<const spatialIndex> spatial_index;
+
+std::string calibration_file;
+
+bool refine = false;
+float refine_period = 10;
+float refine_voxel_size = 0.02;
+std::atomic<bool> refine_wanted(false);
+std::atomic<bool> refine_snapshot_ready(false);
+pointCloudXYZRGB::Ptr refine_snapshot[MAX_CAMERAS];  // Already in the global frame
+
+// Returns the transform currently in use for a camera. The refinement
+// thread replaces it atomically, so readers never see a half-written matrix.
+Eigen::Matrix4f currentTransform(int index)
+{
+    return stitcher->transform(index);
+}
+
+void setTransform(int index, const Eigen::Matrix4f &tf)
+{
+    stitcher->setTransform(index, tf);
+}
 
 // Exit gracefully by closing all open sockets
 void sigintHandler(int dummy)
 {
     // client.disconnect();
-    for (int i = 0; i < NUM_CAMERAS; i++)
-    {
-        close(sockfd_array[i]);
-    }
+    if (stitcher)
+        stitcher->close();
     close(server_sockfd);
     close(client_sockfd);
 }
@@ -81,7 +213,7 @@ void sigintHandler(int dummy)
 void parseArgs(int argc, char **argv)
 {
     int c;
-    while ((c = getopt(argc, argv, "hftsvd:n")) != -1)
+    while ((c = getopt(argc, argv, "hftsvd:nu:S:F:W:D:R:k:N:XA:L:P:Q:E:G")) != -1)
     {
         switch (c)
         {
@@ -102,12 +234,102 @@ void parseArgs(int argc, char **argv)
             break;
         // Visualizes the pointcloud in real time
         case 'v':
+#ifdef PCS_HEADLESS
+            std::cerr << "Built headless (BUILD_VIEWER=OFF), -v is not available" << std::endl;
+            exit(EXIT_FAILURE);
+#endif
             visual = true;
             break;
         // Sets downsampling factor by specified amount
         case 'd':
             downsample = atoi(optarg);
             break;
+        // Receives the edge streams over UDP, joining the group if it is multicast
+        case 'u':
+            udp = true;
+            udp_group = optarg;
+            break;
+        // Fuses the cameras into a voxel map with the given voxel size in meters
+        case 'F':
+            fusion = true;
+            fusion_voxel_size = atof(optarg);
+            break;
+        // Keeps fused voxels for this many frames after they were last seen
+        case 'W':
+            fusion_window = std::max(1, atoi(optarg));
+            break;
+        // Removes duplicate points between overlapping cameras within the given radius in meters
+        case 'D':
+            dedup = true;
+            dedup_radius = atof(optarg);
+            break;
+        // Refines the camera extrinsics in the background every given number of seconds
+        case 'R':
+            refine = true;
+            refine_period = atof(optarg);
+            break;
+        // Loads the camera transforms from a pcs-calibrate file
+        case 'k':
+            calibration_file = optarg;
+            break;
+        // NUMA node of each camera's receive buffer, as a comma separated list
+        case 'N':
+        {
+            char *arg = optarg;
+            for (int i = 0; i < MAX_CAMERAS && *arg; i++)
+            {
+                numa_node[i] = strtol(arg, &arg, 10);
+                if (*arg == ',')
+                    arg++;
+            }
+            break;
+        }
+        // Locks the receive buffers in RAM
+        case 'X':
+            lock_memory = true;
+            break;
+        // Republishes the stitched cloud to subscribers on this port
+        case 'P':
+            publish_port = atoi(optarg);
+            break;
+        // Indexes every stitched frame and answers spatial queries on this port
+        case 'Q':
+            query_port = atoi(optarg);
+            break;
+        // Point budget of the viewer, 0 renders the full cloud
+        case 'L':
+            lod_budget = std::max(0, atoi(optarg));
+            break;
+        // Pins a thread role to CPUs, as <role>=<cpus>[:<fifo priority>]
+        case 'A':
+            if (!parseAffinity(optarg))
+            {
+                std::cerr << "Bad affinity " << optarg << ", expected <role>=<cpus>[:<priority>]" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            break;
+        // Receives every camera from one edge server that drives them all
+        case 'E':
+            edge_node = optarg;
+            break;
+        // Stitches only the foreground of edge servers that remove the background
+        case 'G':
+            foreground_only = true;
+            break;
+        // Reads one camera from a co-located edge server's shared memory, as <index>:<name>
+        case 'S':
+        {
+            std::string arg(optarg);
+            size_t sep = arg.find(':');
+            int index = atoi(arg.substr(0, sep).c_str());
+            if (sep == std::string::npos || index < 0 || index >= num_cameras)
+            {
+                std::cerr << "Expected -S <camera index>:<name>" << std::endl;
+                exit(EXIT_FAILURE);
+            }
+            shm_name[index] = "/" + arg.substr(sep + 1);
+            break;
+        }
         default:
         case 'h':
             std::cout << "\nMulticamera pointcloud stitching" << std::endl;
@@ -120,242 +342,1438 @@ void parseArgs(int argc, char **argv)
             std::cout << " -s (save)        Saves 20 frames in a .ply format" << std::endl;
             std::cout << " -v (visualize)   Visualizes the pointclouds using PCL visualizer" << std::endl;
             std::cout << " -d (downsample)  Downsamples the stitched pointcloud by the specified integer" << std::endl;
+            std::cout << " -u (udp) <group> Receive over UDP on port " << SERVER_PORT << " + camera index, joining <group> if multicast" << std::endl;
+            std::cout << " -S (shm) <i:name> Read camera i from the shared-memory ring of a local edge server" << std::endl;
+            std::cout << " -E (edge) <ip>   Receive all cameras (up to " << MAX_CAMERAS
+                      << ") over one connection to an edge server driving them; more than two need -k" << std::endl;
+            std::cout << " -G (foreground)  Leave out the background of edge servers that remove it (-g)" << std::endl;
+            std::cout << " -F (fuse) <size> Fuse the cameras into a voxel map with <size> m voxels" << std::endl;
+            std::cout << " -W (window) <n>  Keep fused voxels for n frames after they were last seen" << std::endl;
+            std::cout << " -D (dedup) <r>   Remove duplicate points of overlapping cameras within r m" << std::endl;
+            std::cout << " -R (refine) <s>  Refine the camera extrinsics with ICP every s seconds" << std::endl;
+            std::cout << " -k (calib) <file> Load the camera transforms from a pcs-calibrate file" << std::endl;
+            std::cout << " -N (numa) <n,..> NUMA node of each camera's receive buffer" << std::endl;
+            std::cout << " -X (lock)        Lock the receive buffers in RAM" << std::endl;
+            std::cout << " -P (publish) <port> Serve the stitched cloud to subscribers" << std::endl;
+            std::cout << " -Q (query) <port> Index each frame and serve box, radius and k-NN queries" << std::endl;
+            std::cout << " -L (lod) <n>     Render at most n points, from the LOD pyramid (default "
+                      << LOD_DEFAULT_BUDGET << ", 0 for all)" << std::endl;
+            std::cout << " -A (affinity) <role>=<cpus>[:<prio>] Pin receiver, compute, render or sender threads," << std::endl;
+            std::cout << "                  optionally SCHED_FIFO at the given priority" << std::endl;
             exit(0);
         }
     }
 }
 
-// Create TCP socket with specific port and IP address.
-int initSocket(int port, std::string ip_addr, int index)
+// Logs the quality changes signaled by a camera's adaptive quality controller.
+void noteQuality(int index, int level)
 {
+    if (level == camera_quality[index])
+        return;
 
-    std::cout << "i0 port:" << port << "Ip" << ip_addr << std::endl;
+    std::cout << "Camera " << index << " quality level " << camera_quality[index] << " -> " << level << std::endl;
+    camera_quality[index] = level;
+}
 
-    struct sockaddr_in serv_addr;
-    memset(&serv_addr, 0, sizeof(serv_addr));
+// Sparse voxel map the camera clouds are fused into (-F). Open addressing
+// with CAS on the key, so the camera threads insert and update voxels
+// concurrently without locks.
+struct fusionVoxel
+{
+    std::atomic<uint64_t> key;          // 0 while the slot is empty
+    std::atomic<uint32_t> last_seen;    // Last frame the voxel was hit in
+    std::atomic<uint32_t> count;        // Points this frame
+    std::atomic<uint32_t> r_sum;        // Color sums this frame; a frame has far
+    std::atomic<uint32_t> g_sum;        // fewer than 2^32 / 255 points, so they
+    std::atomic<uint32_t> b_sum;        // can't overflow
+    uint32_t rgb;                       // Average color when last seen
+};
+
+// Key of the voxel containing the point, 21 bits per axis. The top bit is
+// set so a valid key is never 0.
+inline uint64_t voxelKey(float x, float y, float z, float inv_size)
+{
+    const int64_t offset = 1 << 20;
+    uint64_t ix = (uint64_t)(int64_t(std::floor(x * inv_size)) + offset) & 0x1FFFFF;
+    uint64_t iy = (uint64_t)(int64_t(std::floor(y * inv_size)) + offset) & 0x1FFFFF;
+    uint64_t iz = (uint64_t)(int64_t(std::floor(z * inv_size)) + offset) & 0x1FFFFF;
+    return (1ULL << 63) | (ix << 42) | (iy << 21) | iz;
+}
 
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_port = htons(port);
-    serv_addr.sin_addr.s_addr = inet_addr(ip_addr.c_str());
+// Center of the voxel with the given key.
+inline void voxelCenter(uint64_t key, float size, float *x, float *y, float *z)
+{
+    const int64_t offset = 1 << 20;
+    *x = (float(int64_t((key >> 42) & 0x1FFFFF) - offset) + 0.5f) * size;
+    *y = (float(int64_t((key >> 21) & 0x1FFFFF) - offset) + 0.5f) * size;
+    *z = (float(int64_t(key & 0x1FFFFF) - offset) + 0.5f) * size;
+}
 
-    std::cout << "i1" << std::endl;
+// Finds or claims the slot for a key, or returns -1 if the probe limit is hit.
+long findVoxel(uint64_t key)
+{
+    uint64_t slot = (key * 0x9E3779B97F4A7C15ULL) >> (64 - fusion_bits);
 
-    // Create socket
-    if ((sockfd_array[index] = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+    for (int probe = 0; probe < FUSION_MAX_PROBE; probe++)
     {
-        std::cerr << "Couldn't create socket" << std::endl;
-        exit(EXIT_FAILURE);
+        fusionVoxel &v = fusion_map[slot];
+        uint64_t current = v.key.load(std::memory_order_acquire);
+
+        if (current == key)
+            return slot;
+        if (current == 0)
+        {
+            if (v.key.compare_exchange_strong(current, key, std::memory_order_acq_rel))
+            {
+                fusion_voxels++;
+                return slot;
+            }
+            if (current == key)
+                return slot;
+        }
+        slot = (slot + 1) & ((1ULL << fusion_bits) - 1);
     }
 
-    std::cout << "i2" << std::endl;
+    return -1;
+}
+
+// Adds one camera's transformed cloud to the voxel map. Runs on the camera's
+// own thread; voxels first hit this frame are recorded for extraction.
+void integrateCloud(int thread_num, const pointCloudXYZRGB &cloud)
+{
+    const float inv_size = 1.0f / fusion_voxel_size;
+    std::vector<uint32_t> &touched = fusion_touched[thread_num];
+    touched.clear();
 
-    // Connect to camera server
-    if ((connect(sockfd_array[index], (struct sockaddr *)&serv_addr, sizeof(serv_addr))) < 0)
+    for (const auto &p : cloud.points)
     {
-        std::cerr << "Connection failed at " << ip_addr << "." << std::endl;
-        exit(EXIT_FAILURE);
+        if (!std::isfinite(p.x) || (p.x == 0 && p.y == 0 && p.z == 0))
+            continue;
+
+        long slot = findVoxel(voxelKey(p.x, p.y, p.z, inv_size));
+        if (slot < 0)
+        {
+            fusion_dropped++;
+            continue;
+        }
+
+        fusionVoxel &v = fusion_map[slot];
+        if (v.last_seen.exchange(fusion_frame, std::memory_order_relaxed) != fusion_frame)
+            touched.push_back(slot);
+
+        v.count.fetch_add(1, std::memory_order_relaxed);
+        v.r_sum.fetch_add(p.r, std::memory_order_relaxed);
+        v.g_sum.fetch_add(p.g, std::memory_order_relaxed);
+        v.b_sum.fetch_add(p.b, std::memory_order_relaxed);
     }
+}
 
-    std::cout << "i3" << std::endl;
+// Replaces the stitched cloud with the centers of the occupied voxels. A
+// voxel stays in the output for fusion_window frames after it was last hit.
+// Output size is bounded by the scene volume, not by the number of cameras.
+void extractFusedCloud(pointCloudXYZRGB::Ptr stitched_cloud)
+{
+    // Voxels hit this frame: settle their color and reset the accumulators
+    std::vector<uint32_t> current;
+    for (int i = 0; i < num_cameras; i++)
+        current.insert(current.end(), fusion_touched[i].begin(), fusion_touched[i].end());
 
-    std::cout << "Connection made at " << sockfd_array[index] << std::endl;
-    return 0;
+    #pragma omp parallel for schedule(static)
+    for (size_t k = 0; k < current.size(); k++)
+    {
+        fusionVoxel &v = fusion_map[current[k]];
+        uint32_t n = v.count.exchange(0, std::memory_order_relaxed);
+        uint32_t r = v.r_sum.exchange(0, std::memory_order_relaxed);
+        uint32_t g = v.g_sum.exchange(0, std::memory_order_relaxed);
+        uint32_t b = v.b_sum.exchange(0, std::memory_order_relaxed);
+        if (!n)
+            continue;
+        r /= n;
+        g /= n;
+        b /= n;
+        v.rgb = (r << 16) | (g << 8) | b;
+    }
+
+    fusion_history.push_back(std::move(current));
+    while ((int)fusion_history.size() > fusion_window)
+        fusion_history.pop_front();
+
+    // Each voxel is emitted once, from the newest frame it was hit in
+    stitched_cloud->clear();
+    for (size_t h = 0; h < fusion_history.size(); h++)
+    {
+        uint32_t frame = fusion_frame - (fusion_history.size() - 1 - h);
+        for (uint32_t slot : fusion_history[h])
+        {
+            fusionVoxel &v = fusion_map[slot];
+            if (v.last_seen.load(std::memory_order_relaxed) != frame)
+                continue;
+
+            pcl::PointXYZRGB p;
+            voxelCenter(v.key.load(std::memory_order_relaxed), fusion_voxel_size, &p.x, &p.y, &p.z);
+            p.r = (v.rgb >> 16) & 0xFF;
+            p.g = (v.rgb >> 8) & 0xFF;
+            p.b = v.rgb & 0xFF;
+            stitched_cloud->points.push_back(p);
+        }
+    }
+    stitched_cloud->width = stitched_cloud->points.size();
+    stitched_cloud->height = 1;
+    stitched_cloud->is_dense = true;
+
+    fusion_frame++;
+
+    // The map has no deletion, so start over once it is half full
+    if (fusion_voxels > (1L << fusion_bits) / 2)
+    {
+        #pragma omp parallel for schedule(static)
+        for (long slot = 0; slot < (1L << fusion_bits); slot++)
+        {
+            fusion_map[slot].key.store(0, std::memory_order_relaxed);
+            fusion_map[slot].last_seen.store(0, std::memory_order_relaxed);
+        }
+        fusion_voxels = 0;
+        fusion_history.clear();
+        fusion_frame++;
+        std::cout << "Voxel map full, cleared" << std::endl;
+    }
+}
+
+// Allocates the voxel map.
+void initFusion()
+{
+    fusion_map = new fusionVoxel[1L << fusion_bits]();
+    std::cout << "Fusing into " << fusion_voxel_size * 100 << " cm voxels ("
+              << (1L << fusion_bits) * sizeof(fusionVoxel) / (1 << 20) << " MBytes map)" << std::endl;
 }
 
-// Sends pull request to socket to signal server to send pointcloud data.
-void sendPullRequest(int sockfd, char pull_char)
+// Builds one level of the LOD pyramid: the first point of every voxel of
+// the given size. Like the dedup, points are bucketed into shards by voxel
+// hash and each shard is thinned by one thread with its own table.
+void buildLodLevel(const pointCloudXYZRGB &src, float voxel_size, pointCloudXYZRGB &dst)
 {
-    if (send(sockfd, &pull_char, 1, 0) < 0)
+    const size_t n = src.points.size();
+    const float inv_size = 1.0f / voxel_size;
+    const int num_threads = omp_get_max_threads();
+
+    std::vector<uint64_t> keys(n);
+    std::vector<std::vector<std::vector<uint32_t>>> buckets(num_threads, std::vector<std::vector<uint32_t>>(DEDUP_SHARDS));
+    std::vector<std::vector<uint32_t>> kept(DEDUP_SHARDS);
+
+    #pragma omp parallel num_threads(num_threads)
     {
-        std::cerr << "Pull request failure from sockfd: " << sockfd << std::endl;
-        exit(EXIT_FAILURE);
+        std::vector<std::vector<uint32_t>> &local = buckets[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for (size_t k = 0; k < n; k++)
+        {
+            const pcl::PointXYZRGB &p = src.points[k];
+            keys[k] = voxelKey(p.x, p.y, p.z, inv_size);
+            local[(keys[k] * 0x9E3779B97F4A7C15ULL) >> (64 - DEDUP_SHARD_BITS)].push_back(k);
+        }
     }
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+    {
+        std::unordered_set<uint64_t> seen;
+        for (int t = 0; t < num_threads; t++)
+        {
+            for (uint32_t k : buckets[t][shard])
+            {
+                if (seen.insert(keys[k]).second)
+                    kept[shard].push_back(k);
+            }
+        }
+    }
+
+    std::vector<size_t> offsets(DEDUP_SHARDS + 1, 0);
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+        offsets[shard + 1] = offsets[shard] + kept[shard].size();
+
+    dst.points.resize(offsets.back());
+    dst.width = offsets.back();
+    dst.height = 1;
+    dst.is_dense = false;
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+    {
+        for (size_t j = 0; j < kept[shard].size(); j++)
+            dst.points[offsets[shard] + j] = src.points[kept[shard][j]];
+    }
+}
+
+// Starts the pyramid of a new frame.
+void beginLod(pointCloudXYZRGB::Ptr cloud)
+{
+    lod_levels[0] = cloud;
+    lod_built = 1;
+}
+
+// Returns a level of the current frame's pyramid, building the missing
+// levels each from the one above.
+pointCloudXYZRGB::Ptr lodLevel(int level)
+{
+    level = std::min(level, LOD_LEVELS - 1);
+    while (lod_built <= level)
+    {
+        // A level still held by the publisher is replaced, not overwritten
+        if (!lod_levels[lod_built] || lod_levels[lod_built].use_count() > 1)
+            lod_levels[lod_built] = pointCloudXYZRGB::Ptr(new pointCloudXYZRGB);
+        buildLodLevel(*lod_levels[lod_built - 1], LOD_BASE_VOXEL * (1 << (lod_built - 1)), *lod_levels[lod_built]);
+        lod_built++;
+    }
+    return lod_levels[level];
+}
+
+// Returns the finest level of the pyramid within the point budget. A budget
+// of 0 selects the full cloud.
+pointCloudXYZRGB::Ptr lodForBudget(size_t budget)
+{
+    timePoint lod_start = std::chrono::high_resolution_clock::now();
+
+    int level = 0;
+    while (budget && lodLevel(level)->size() > budget && level + 1 < LOD_LEVELS)
+        level++;
+
+    if (timer && level)
+    {
+        timePoint lod_end = std::chrono::high_resolution_clock::now();
+        std::cout << "LOD: level " << level << " (" << LOD_BASE_VOXEL * (1 << (level - 1)) * 1000 << " mm), "
+                  << lod_levels[level]->size() << " of " << lod_levels[0]->size() << " points in "
+                  << timeMilli(lod_end - lod_start).count() << " ms" << std::endl;
+    }
+
+    return lodLevel(level);
 }
 
-// Helper function to read N bytes from the buffer to ensure that
-// the entire buffer has been read from.
-void readNBytes(int sockfd, unsigned int n, void *buffer)
+// Writes n bytes, continuing after partial sends. Returns false if the peer is gone.
+bool sendNBytes(int sockfd, const char *data, size_t n)
 {
-    int total_bytes, bytes_read;
-    total_bytes = 0;
+    size_t total_bytes = 0;
 
-    // Keep reading until N total_bytes have been read
     while (total_bytes < n)
     {
-        if ((bytes_read = read(sockfd, buffer + total_bytes, n - total_bytes)) < 1)
+        ssize_t bytes_sent = send(sockfd, data + total_bytes, n - total_bytes, MSG_NOSIGNAL);
+        if (bytes_sent < 0)
         {
-            std::cerr << "Receive failure" << std::endl;
-            exit(EXIT_FAILURE);
+            if (errno == EINTR)
+                continue;
+            return false;
         }
+        total_bytes += bytes_sent;
+    }
+
+    return true;
+}
+
+// Packs a cloud for one kind of subscription: cropped, converted to the
+// five-short point format and optionally zlib compressed.
+std::shared_ptr<const std::vector<char>> encodeFrame(const pointCloudXYZRGB &cloud, const subscribeRequest &request,
+                                                     uint32_t frame_id)
+{
+    const bool crop = request.crop_min[0] <= request.crop_max[0] && request.crop_min[1] <= request.crop_max[1] &&
+                      request.crop_min[2] <= request.crop_max[2];
+
+    std::vector<short> points;
+    points.reserve(cloud.size() * 5);
+    for (const pcl::PointXYZRGB &p : cloud.points)
+    {
+        if (crop && (p.x < request.crop_min[0] || p.x > request.crop_max[0] || p.y < request.crop_min[1] ||
+                     p.y > request.crop_max[1] || p.z < request.crop_min[2] || p.z > request.crop_max[2]))
+            continue;
+
+        points.push_back(short(p.x * CONV_RATE));
+        points.push_back(short(p.y * CONV_RATE));
+        points.push_back(short(p.z * CONV_RATE));
+        points.push_back(short(p.r + (p.g << 8)));
+        points.push_back(short(p.b));
+    }
 
-        total_bytes += bytes_read;
+    publishHeader header;
+    header.magic = PUBLISH_MAGIC;
+    header.frame_id = frame_id;
+    header.num_points = points.size() / 5;
+    header.raw_bytes = points.size() * sizeof(short);
+    header.lod = request.lod;
+    header.compression = request.compression;
+    header.reserved = 0;
+
+    auto frame = std::make_shared<std::vector<char>>();
+    bool compressed = false;
+    if (request.compression)
+    {
+        uLongf size = compressBound(header.raw_bytes);
+        frame->resize(sizeof(header) + size);
+        compressed = compress2((Bytef *)frame->data() + sizeof(header), &size, (const Bytef *)points.data(),
+                               header.raw_bytes, std::min<int>(request.compression, Z_BEST_COMPRESSION)) == Z_OK;
+        header.size = size;
     }
+
+    // Sent raw if not asked for compression or if zlib failed
+    if (!compressed)
+    {
+        header.compression = 0;
+        header.size = header.raw_bytes;
+        frame->resize(sizeof(header) + header.size);
+        memcpy(frame->data() + sizeof(header), points.data(), header.size);
+    }
+
+    frame->resize(sizeof(header) + header.size);
+    memcpy(frame->data(), &header, sizeof(header));
+    return frame;
 }
 
-// Parses the buffer and converts the short values into float points and
-// puts the XYZ and RGB values into the pointcloud.
-pointCloudXYZRGB::Ptr convertBufferToPointCloudXYZRGB(short *buffer, int size)
+// Reads one subscriber's subscription, then sends the frames queued for it
+// until it disconnects. The subscription is read here rather than on the
+// accept thread, so a client that never sends one only stalls itself.
+void subscriberLoop(std::shared_ptr<subscriber> sub)
 {
-    int count = 0;
-    pointCloudXYZRGB::Ptr new_cloud(new pointCloudXYZRGB);
+    pinThread(ROLE_SENDER);
 
-    new_cloud->width = size / downsample;
-    new_cloud->height = 1;
-    new_cloud->is_dense = false;
-    new_cloud->points.resize(new_cloud->width);
+    if (recv(sub->sockfd, &sub->request, sizeof(sub->request), MSG_WAITALL) != sizeof(sub->request) ||
+        sub->request.magic != PUBLISH_MAGIC)
+    {
+        std::cerr << "Bad subscription on " << sub->sockfd << std::endl;
+        close(sub->sockfd);
+        releaseThread(ROLE_SENDER);
+        return;
+    }
 
-    for (int i = 0; i < size; i++)
+    std::cout << "Subscriber " << sub->sockfd << ": LOD " << int(sub->request.lod) << ", compression "
+              << int(sub->request.compression) << std::endl;
     {
-        if (i % downsample == 0)
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        subscribers.push_back(sub);
+    }
+
+    while (1)
+    {
+        std::shared_ptr<const std::vector<char>> frame;
         {
-            new_cloud->points[count].x = (float)buffer[i * 5 + 0] / CONV_RATE;
-            new_cloud->points[count].y = (float)buffer[i * 5 + 1] / CONV_RATE;
-            new_cloud->points[count].z = (float)buffer[i * 5 + 2] / CONV_RATE;
-            new_cloud->points[count].r = (uint8_t)(buffer[i * 5 + 3] & 0xFF);
-            new_cloud->points[count].g = (uint8_t)(buffer[i * 5 + 3] >> 8);
-            new_cloud->points[count].b = (uint8_t)(buffer[i * 5 + 4] & 0xFF);
-            count++;
+            std::unique_lock<std::mutex> lock(sub->mutex);
+            sub->cv.wait(lock, [&] { return !sub->queue.empty(); });
+            frame = sub->queue.front();
+            sub->queue.pop_front();
         }
+
+        if (!sendNBytes(sub->sockfd, frame->data(), frame->size()))
+            break;
+        sub->sent++;
+    }
+
+    std::cout << "Subscriber " << sub->sockfd << " disconnected after " << sub->sent << " frames ("
+              << sub->dropped << " dropped)" << std::endl;
+    {
+        std::lock_guard<std::mutex> lock(sub->mutex);
+        sub->alive = false;
     }
+    close(sub->sockfd);
+    releaseThread(ROLE_SENDER);
+}
+
+// Accepts subscribers of the stitched cloud. Each one gets a sender thread,
+// which reads its subscription first.
+void publishLoop()
+{
+    while (1)
+    {
+        int sockfd = accept(server_sockfd, NULL, NULL);
+        if (sockfd < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("Subscriber accept failed");
+            return;
+        }
 
-    return new_cloud;
+        auto sub = std::make_shared<subscriber>();
+        sub->sockfd = sockfd;
+        std::thread(subscriberLoop, sub).detach();
+    }
 }
 
-// Reads from the buffer and converts the data into a new XYZRGB pointcloud.
-void updateCloudXYZRGB(int thread_num, int sockfd, pointCloudXYZRGB::Ptr cloud)
+// Encodes the frames handed over by publishFrame and queues them for the
+// subscribers. Each distinct subscription is encoded once, however many
+// subscribers share it; subscribers with a full queue lose their oldest
+// frame.
+void publisherLoop()
 {
-    double update_total, convert_total;
-    timePoint loop_start, loop_end, read_start, read_end_convert_start, convert_end;
+    pinThread(ROLE_SENDER);
 
-    if (timer)
-        read_start = std::chrono::high_resolution_clock::now();
+    while (1)
+    {
+        std::unique_ptr<publishJob> job;
+        {
+            std::unique_lock<std::mutex> lock(publish_mutex);
+            publish_cv.wait(lock, [] { return publish_job != nullptr; });
+            job = std::move(publish_job);
+        }
+        timePoint publish_start = std::chrono::high_resolution_clock::now();
+
+        std::map<std::string, std::shared_ptr<const std::vector<char>>> encoded;
+        for (auto &sub : job->subscribers)
+        {
+            std::string key((const char *)&sub->request, sizeof(sub->request));
+            auto it = encoded.find(key);
+            if (it == encoded.end())
+                it = encoded.emplace(key, encodeFrame(*job->levels[sub->request.lod], sub->request, job->frame_id)).first;
+
+            std::lock_guard<std::mutex> lock(sub->mutex);
+            if (sub->queue.size() >= PUBLISH_QUEUE_DEPTH)
+            {
+                sub->queue.pop_front();
+                sub->dropped++;
+            }
+            sub->queue.push_back(it->second);
+            sub->cv.notify_one();
+        }
+
+        if (timer)
+        {
+            timePoint publish_end = std::chrono::high_resolution_clock::now();
+            std::cout << "Publish: " << job->subscribers.size() << " subscribers, " << encoded.size()
+                      << " encodings in " << timeMilli(publish_end - publish_start).count() << " ms ("
+                      << publish_skipped << " frames skipped)" << std::endl;
+        }
+    }
+}
 
-    short *cloud_buf = (short *)malloc(sizeof(short) * BUF_SIZE);
-    int size;
+// Hands the current frame to the publisher thread, with the pyramid levels
+// its subscribers asked for. Only the levels are built here; cropping,
+// conversion and compression stay off the stitching thread. A frame the
+// publisher has not taken yet is replaced.
+void publishFrame()
+{
+    std::unique_ptr<publishJob> job(new publishJob);
+    {
+        std::lock_guard<std::mutex> lock(subscribers_mutex);
+        subscribers.erase(std::remove_if(subscribers.begin(), subscribers.end(),
+                                         [](const std::shared_ptr<subscriber> &sub) {
+                                             std::lock_guard<std::mutex> sub_lock(sub->mutex);
+                                             return !sub->alive;
+                                         }),
+                          subscribers.end());
+        job->subscribers = subscribers;
+    }
+    if (job->subscribers.empty())
+        return;
 
-    // Read the first integer to determine the size being sent, then read in pointcloud
-    readNBytes(sockfd, sizeof(int), (void *)&size);
-    readNBytes(sockfd, size, (void *)&cloud_buf[0]);
-    // Send a pull_XYZRGB request after finished reading from buffer
-    sendPullRequest(sockfd, PULL_XYZRGB);
+    job->frame_id = publish_frame++;
+    for (auto &sub : job->subscribers)
+    {
+        if (!job->levels.count(sub->request.lod))
+            job->levels[sub->request.lod] = lodLevel(sub->request.lod);
+    }
 
-    if (timer)
-        read_end_convert_start = std::chrono::high_resolution_clock::now();
+    {
+        std::lock_guard<std::mutex> lock(publish_mutex);
+        if (publish_job)
+            publish_skipped++;
+        publish_job = std::move(job);
+    }
+    publish_cv.notify_one();
+}
+
+// Opens the publishing socket and starts accepting subscribers.
+void initPublisher(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    int opt = 1;
+    if ((server_sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0 ||
+        setsockopt(server_sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(server_sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(server_sockfd, 8) < 0)
+    {
+        perror("Publisher setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Publishing the stitched cloud on port " << port << std::endl;
+    std::thread(publishLoop).detach();
+    std::thread(publisherLoop).detach();
+}
+
+inline int cellShard(uint64_t key)
+{
+    return (key * 0x9E3779B97F4A7C15ULL) >> (64 - DEDUP_SHARD_BITS);
+}
+
+// Key of the cell with the given integer coordinates, as voxelKey.
+inline uint64_t cellKey(int64_t ix, int64_t iy, int64_t iz)
+{
+    const int64_t offset = 1 << 20;
+    return (1ULL << 63) | ((uint64_t)(ix + offset) & 0x1FFFFF) << 42 | ((uint64_t)(iy + offset) & 0x1FFFFF) << 21 |
+           ((uint64_t)(iz + offset) & 0x1FFFFF);
+}
+
+// Integer coordinates of the cell with the given key, the inverse of cellKey.
+inline void cellCoords(uint64_t key, int64_t c[3])
+{
+    const int64_t offset = 1 << 20;
+    c[0] = int64_t((key >> 42) & 0x1FFFFF) - offset;
+    c[1] = int64_t((key >> 21) & 0x1FFFFF) - offset;
+    c[2] = int64_t(key & 0x1FFFFF) - offset;
+}
+
+// Cell coordinate of a query position, scaled as in voxelKey so it agrees
+// with the keys on cell boundaries. Far out positions are clamped, keeping
+// the conversion defined.
+inline int64_t queryCell(float v)
+{
+    const float limit = float(1 << 30);
+    return int64_t(std::floor(std::max(-limit, std::min(limit, v * (1.0f / SPATIAL_CELL)))));
+}
+
+// Latest spatial index, safe to use from any thread while the next one is built.
+std::shared_ptr<const spatialIndex> currentSpatialIndex()
+{
+    return std::atomic_load(&spatial_index);
+}
+
+// Indexes a frame: cell keys and shard buckets per thread, then each shard
+// sorts its points by cell and records the cell ranges.
+void buildSpatialIndex(const pointCloudXYZRGB &cloud)
+{
+    timePoint index_start = std::chrono::high_resolution_clock::now();
+
+    const size_t n = cloud.points.size();
+    const float inv_size = 1.0f / SPATIAL_CELL;
+    const int num_threads = omp_get_max_threads();
 
-    // Parse the pointcloud and perform transformation according to camera position
-    *cloud = *convertBufferToPointCloudXYZRGB(&cloud_buf[0], size / sizeof(short) / 5);
-    pcl::transformPointCloud(*cloud, *cloud, transform[thread_num]);
+    auto index = std::make_shared<spatialIndex>();
+    std::vector<uint64_t> keys(n);
+    std::vector<std::vector<std::vector<uint32_t>>> buckets(num_threads, std::vector<std::vector<uint32_t>>(DEDUP_SHARDS));
+    std::vector<std::vector<std::pair<uint64_t, uint32_t>>> sorted(DEDUP_SHARDS);
 
-    free(cloud_buf);
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<std::vector<uint32_t>> &local = buckets[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for (size_t k = 0; k < n; k++)
+        {
+            const pcl::PointXYZRGB &p = cloud.points[k];
+            keys[k] = voxelKey(p.x, p.y, p.z, inv_size);
+            local[cellShard(keys[k])].push_back(k);
+        }
+    }
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+    {
+        for (int t = 0; t < num_threads; t++)
+        {
+            for (uint32_t k : buckets[t][shard])
+                sorted[shard].emplace_back(keys[k], k);
+        }
+        std::sort(sorted[shard].begin(), sorted[shard].end());
+    }
+
+    std::vector<size_t> offsets(DEDUP_SHARDS + 1, 0);
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+        offsets[shard + 1] = offsets[shard] + sorted[shard].size();
+    index->points.resize(n);
+
+    #pragma omp parallel for schedule(dynamic) num_threads(num_threads)
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+    {
+        auto &cells = index->cells[shard];
+        auto cell = cells.end();
+        for (size_t j = 0; j < sorted[shard].size(); j++)
+        {
+            uint32_t slot = offsets[shard] + j;
+            index->points[slot] = cloud.points[sorted[shard][j].second];
+            if (j == 0 || sorted[shard][j].first != sorted[shard][j - 1].first)
+                cell = cells.emplace(sorted[shard][j].first, std::make_pair(slot, 0u)).first;
+            cell->second.second++;
+        }
+    }
+
+    // Bounds of the occupied cells, which end the nearest neighbor search
+    for (int a = 0; a < 3; a++)
+    {
+        index->min_cell[a] = INT64_MAX;
+        index->max_cell[a] = INT64_MIN;
+    }
+    for (const pcl::PointXYZRGB &p : index->points)
+    {
+        const float c[3] = {p.x, p.y, p.z};
+        for (int a = 0; a < 3; a++)
+        {
+            int64_t cell = std::floor(c[a] * inv_size);
+            index->min_cell[a] = std::min(index->min_cell[a], cell);
+            index->max_cell[a] = std::max(index->max_cell[a], cell);
+        }
+    }
+
+    timePoint index_end = std::chrono::high_resolution_clock::now();
+    index->frame_id = index_frame++;
+    index->build_ms = timeMilli(index_end - index_start).count();
+    index_total_ms += index->build_ms;
+    std::atomic_store(&spatial_index, std::shared_ptr<const spatialIndex>(index));
 
     if (timer)
+        std::cout << "Spatial index: " << n << " points in " << index->build_ms << " ms (average "
+                  << index_total_ms / index_frame << " ms)" << std::endl;
+}
+
+// Calls fn(first, count) for every occupied cell in the cell range.
+template <typename F>
+void forEachCell(const spatialIndex &index, const int64_t lo[3], const int64_t hi[3], F fn)
+{
+    double range = double(hi[0] - lo[0] + 1) * (hi[1] - lo[1] + 1) * (hi[2] - lo[2] + 1);
+    size_t occupied = 0;
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+        occupied += index.cells[shard].size();
+
+    // Large ranges are cheaper to answer from the occupied cells
+    if (range > occupied)
     {
-        convert_end = std::chrono::high_resolution_clock::now();
-        std::cout << "updateCloud " << thread_num << ": " << timeMilli(convert_end - read_end_convert_start).count() << " ms" << std::endl;
+        for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+        {
+            for (const auto &cell : index.cells[shard])
+            {
+                int64_t c[3];
+                cellCoords(cell.first, c);
+                if (c[0] >= lo[0] && c[0] <= hi[0] && c[1] >= lo[1] && c[1] <= hi[1] && c[2] >= lo[2] && c[2] <= hi[2])
+                    fn(cell.second.first, cell.second.second);
+            }
+        }
+        return;
     }
+
+    for (int64_t ix = lo[0]; ix <= hi[0]; ix++)
+        for (int64_t iy = lo[1]; iy <= hi[1]; iy++)
+            for (int64_t iz = lo[2]; iz <= hi[2]; iz++)
+            {
+                uint64_t key = cellKey(ix, iy, iz);
+                const auto &cells = index.cells[cellShard(key)];
+                auto it = cells.find(key);
+                if (it != cells.end())
+                    fn(it->second.first, it->second.second);
+            }
 }
 
-// Primary function to update the pointcloud viewer with an XYZRGB pointcloud.
-void runStitching()
+// Points inside the axis aligned box, as indices into index.points.
+void queryBox(const spatialIndex &index, const float min[3], const float max[3], std::vector<uint32_t> &out)
+{
+    int64_t lo[3], hi[3];
+    for (int a = 0; a < 3; a++)
+    {
+        lo[a] = std::max(queryCell(min[a]), index.min_cell[a]);
+        hi[a] = std::min(queryCell(max[a]), index.max_cell[a]);
+        if (lo[a] > hi[a])
+            return;
+    }
+
+    forEachCell(index, lo, hi, [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            const pcl::PointXYZRGB &p = index.points[i];
+            if (p.x >= min[0] && p.x <= max[0] && p.y >= min[1] && p.y <= max[1] && p.z >= min[2] && p.z <= max[2])
+                out.push_back(i);
+        }
+    });
+}
+
+// Points within the radius of the center.
+void queryRadius(const spatialIndex &index, const float center[3], float radius, std::vector<uint32_t> &out)
 {
-    double total;
-    timePoint loop_start, loop_end, stitch_start, stitch_end_viewer_start;
+    const float min[3] = {center[0] - radius, center[1] - radius, center[2] - radius};
+    const float max[3] = {center[0] + radius, center[1] + radius, center[2] + radius};
+    std::vector<uint32_t> in_box;
+    queryBox(index, min, max, in_box);
+
+    for (uint32_t i : in_box)
+    {
+        const pcl::PointXYZRGB &p = index.points[i];
+        float dx = p.x - center[0], dy = p.y - center[1], dz = p.z - center[2];
+        if (dx * dx + dy * dy + dz * dz <= radius * radius)
+            out.push_back(i);
+    }
+}
 
-    pcl::visualization::PCLVisualizer::Ptr viewer(new pcl::visualization::PCLVisualizer("3D Viewer"));
+// The k nearest points, nearest first. Searches shells of cells around the
+// query cell, from the first one that reaches the occupied bounds, until
+// the k-th distance is inside the searched cube. Once a shell would take
+// more lookups than there are occupied cells, the remaining cells are
+// scanned instead, so a query far from the cloud costs one pass over them.
+void queryNearest(const spatialIndex &index, const float point[3], int k, std::vector<uint32_t> &out)
+{
+    if (k <= 0 || index.points.empty())
+        return;
 
-    std::vector<pointCloudXYZRGB::Ptr, Eigen::aligned_allocator<pointCloudXYZRGB::Ptr>> cloud_ptr(NUM_CAMERAS);
-    pointCloudXYZRGB::Ptr stitched_cloud(new pointCloudXYZRGB);
-    pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> cloud_handler(stitched_cloud);
+    const int64_t c[3] = {queryCell(point[0]), queryCell(point[1]), queryCell(point[2])};
+    int64_t min_ring = 0, max_ring = 0;
+    for (int a = 0; a < 3; a++)
+    {
+        min_ring = std::max(min_ring, std::max(index.min_cell[a] - c[a], c[a] - index.max_cell[a]));
+        max_ring = std::max(max_ring, std::max(c[a] - index.min_cell[a], index.max_cell[a] - c[a]));
+    }
 
-    std::cout << "-1" << std::endl;
+    size_t occupied = 0;
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+        occupied += index.cells[shard].size();
 
-    viewer->setBackgroundColor(0.05, 0.05, 0.05, 0);
+    std::vector<std::pair<float, uint32_t>> heap;   // Max-heap of the best k so far
+    auto consider = [&](uint32_t first, uint32_t count) {
+        for (uint32_t i = first; i < first + count; i++)
+        {
+            const pcl::PointXYZRGB &p = index.points[i];
+            float ex = p.x - point[0], ey = p.y - point[1], ez = p.z - point[2];
+            float d = ex * ex + ey * ey + ez * ez;
+            if ((int)heap.size() < k)
+            {
+                heap.emplace_back(d, i);
+                std::push_heap(heap.begin(), heap.end());
+            }
+            else if (d < heap.front().first)
+            {
+                std::pop_heap(heap.begin(), heap.end());
+                heap.back() = std::make_pair(d, i);
+                std::push_heap(heap.begin(), heap.end());
+            }
+        }
+    };
+
+    int64_t r = min_ring;
+    bool done = false;
+    for (; r <= max_ring && !done; r++)
+    {
+        // A shell has about 24 r^2 cells
+        if (24.0 * r * r > occupied)
+            break;
+
+        for (int64_t dx = -r; dx <= r; dx++)
+            for (int64_t dy = -r; dy <= r; dy++)
+            {
+                // Inside the shell only the two z faces are new
+                bool edge = std::abs(dx) == r || std::abs(dy) == r;
+                for (int64_t dz = -r; dz <= r; dz += (edge || r == 0) ? 1 : 2 * r)
+                {
+                    uint64_t key = cellKey(c[0] + dx, c[1] + dy, c[2] + dz);
+                    const auto &cells = index.cells[cellShard(key)];
+                    auto it = cells.find(key);
+                    if (it != cells.end())
+                        consider(it->second.first, it->second.second);
+                }
+            }
 
-    std::cout << "0" << std::endl;
+        // Anything outside the searched cube is at least r cells away
+        float reach = r * SPATIAL_CELL;
+        done = (int)heap.size() == k && heap.front().first <= reach * reach;
+    }
 
-    // Initializing cloud pointers, pointcloud viewer, and sending pull
-    // requests to each camera server.
-    for (int i = 0; i < NUM_CAMERAS; i++)
+    // Cells of the shells not searched yet
+    if (!done && r <= max_ring)
     {
-        cloud_ptr[i] = pointCloudXYZRGB::Ptr(new pointCloudXYZRGB);
-        sendPullRequest(sockfd_array[i], PULL_XYZRGB);
+        for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+        {
+            for (const auto &cell : index.cells[shard])
+            {
+                int64_t cc[3];
+                cellCoords(cell.first, cc);
+                int64_t ring = std::max(std::abs(cc[0] - c[0]), std::max(std::abs(cc[1] - c[1]), std::abs(cc[2] - c[2])));
+                if (ring >= r)
+                    consider(cell.second.first, cell.second.second);
+            }
+        }
     }
 
-    std::cout << "1" << std::endl;
+    std::sort_heap(heap.begin(), heap.end());
+    for (const auto &entry : heap)
+        out.push_back(entry.second);
+}
 
-    int i = 0;
-    // Loop until the visualizer is stopped
-    while (1)
+// Answers the queries of one client until it disconnects.
+void queryClientLoop(int sockfd)
+{
+    queryRequest request;
+    std::vector<uint32_t> result;
+    std::vector<short> points;
+
+    while (recv(sockfd, &request, sizeof(request), MSG_WAITALL) == sizeof(request) && request.magic == QUERY_MAGIC)
     {
-        if (timer)
-            loop_start = std::chrono::high_resolution_clock::now();
+        // NaN or infinite coordinates have no cell, drop the client
+        bool finite = true;
+        for (int a = 0; a < 3; a++)
+            finite = finite && std::isfinite(request.a[a]) && std::isfinite(request.b[a]);
+        if (!finite)
+        {
+            std::cerr << "Query with non-finite coordinates, closing the connection" << std::endl;
+            break;
+        }
 
-        if (clean)
-            stitched_cloud->clear();
+        std::shared_ptr<const spatialIndex> index = currentSpatialIndex();
+        timePoint query_start = std::chrono::high_resolution_clock::now();
 
-        if (timer)
-            stitch_start = std::chrono::high_resolution_clock::now();
+        result.clear();
+        if (index && request.type == QUERY_BOX)
+            queryBox(*index, request.a, request.b, result);
+        else if (index && request.type == QUERY_RADIUS)
+            queryRadius(*index, request.a, request.b[0], result);
+        else if (index && request.type == QUERY_NEAREST)
+            queryNearest(*index, request.a, request.k, result);
+
+        timePoint query_end = std::chrono::high_resolution_clock::now();
+        if (request.max_points && result.size() > request.max_points)
+            result.resize(request.max_points);
+
+        points.resize(result.size() * 5);
+        for (size_t j = 0; j < result.size(); j++)
+        {
+            const pcl::PointXYZRGB &p = index->points[result[j]];
+            points[j * 5 + 0] = short(p.x * CONV_RATE);
+            points[j * 5 + 1] = short(p.y * CONV_RATE);
+            points[j * 5 + 2] = short(p.z * CONV_RATE);
+            points[j * 5 + 3] = short(p.r + (p.g << 8));
+            points[j * 5 + 4] = short(p.b);
+        }
 
-        // Spawn a thread for each camera and update pointcloud, and perform transformation,
-        for (int i = 0; i < NUM_CAMERAS; i++)
+        queryReply reply;
+        reply.magic = QUERY_MAGIC;
+        reply.frame_id = index ? index->frame_id : 0;
+        reply.num_points = result.size();
+        reply.micros = std::chrono::duration<float, std::micro>(query_end - query_start).count();
+
+        if (!sendNBytes(sockfd, (const char *)&reply, sizeof(reply)) ||
+            !sendNBytes(sockfd, (const char *)points.data(), points.size() * sizeof(short)))
+            break;
+    }
+
+    close(sockfd);
+}
+
+// Serves spatial queries on the port, one thread per client.
+void initQueryServer(int port)
+{
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = INADDR_ANY;
+    addr.sin_port = htons(port);
+
+    int opt = 1;
+    int listen_fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd < 0 || setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)) < 0 ||
+        bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd, 8) < 0)
+    {
+        perror("Query server setup failed");
+        exit(EXIT_FAILURE);
+    }
+
+    std::cout << "Serving spatial queries on port " << port << std::endl;
+    std::thread([listen_fd] {
+        while (1)
+        {
+            int sockfd = accept(listen_fd, NULL, NULL);
+            if (sockfd >= 0)
+                std::thread(queryClientLoop, sockfd).detach();
+            else if (errno != EINTR)
+                return;
+        }
+    }).detach();
+}
+
+// Removes near-duplicate points where cameras overlap (-D). Points are
+// hashed into cells of dedup_radius; in a cell seen by several cameras only
+// the camera with the nearest depth keeps its points. Points of a single
+// camera are never removed against each other. Cells are split into shards
+// by hash, and each shard is resolved by one thread with its own table.
+void removeDuplicatePoints(pointCloudXYZRGB::Ptr stitched_cloud, const std::vector<size_t> &camera_offsets)
+{
+    timePoint dedup_start = std::chrono::high_resolution_clock::now();
+
+    const size_t n = stitched_cloud->points.size();
+    const float inv_size = 1.0f / dedup_radius;
+    const int num_threads = omp_get_max_threads();
+
+    std::vector<uint64_t> keys(n);
+    std::vector<float> depth(n);
+    std::vector<uint8_t> camera(n);
+    std::vector<uint8_t> keep(n, 1);
+    std::vector<std::vector<std::vector<uint32_t>>> buckets(num_threads, std::vector<std::vector<uint32_t>>(DEDUP_SHARDS));
+    Eigen::Matrix4f tfs[MAX_CAMERAS];
+    for (int i = 0; i < num_cameras; i++)
+        tfs[i] = currentTransform(i);
+
+    // Cell key, owning camera and depth along that camera's optical axis
+    #pragma omp parallel num_threads(num_threads)
+    {
+        std::vector<std::vector<uint32_t>> &local = buckets[omp_get_thread_num()];
+
+        #pragma omp for schedule(static)
+        for (size_t k = 0; k < n; k++)
+        {
+            // Points kept from earlier frames (-n) count as the first camera's
+            int cam = std::max(0, int(std::upper_bound(camera_offsets.begin(), camera_offsets.end(), k) - camera_offsets.begin()) - 1);
+            const pcl::PointXYZRGB &p = stitched_cloud->points[k];
+            const Eigen::Matrix4f &tf = tfs[cam];
+
+            keys[k] = voxelKey(p.x, p.y, p.z, inv_size);
+            camera[k] = cam;
+            depth[k] = (p.x - tf(0, 3)) * tf(0, 2) + (p.y - tf(1, 3)) * tf(1, 2) + (p.z - tf(2, 3)) * tf(2, 2);
+            local[(keys[k] * 0x9E3779B97F4A7C15ULL) >> (64 - DEDUP_SHARD_BITS)].push_back(k);
+        }
+    }
+
+    long removed = 0;
+
+    #pragma omp parallel for schedule(dynamic) reduction(+:removed) num_threads(num_threads)
+    for (int shard = 0; shard < DEDUP_SHARDS; shard++)
+    {
+        // Nearest depth and the camera it belongs to, per cell
+        std::unordered_map<uint64_t, std::pair<float, uint8_t>> best;
+
+        for (int t = 0; t < num_threads; t++)
         {
-            pcs_thread[i] = new std::thread(updateCloudXYZRGB, i, sockfd_array[i], cloud_ptr[i]);
+            for (uint32_t k : buckets[t][shard])
+            {
+                auto it = best.find(keys[k]);
+                if (it == best.end())
+                    best.emplace(keys[k], std::make_pair(depth[k], camera[k]));
+                else if (depth[k] < it->second.first)
+                    it->second = std::make_pair(depth[k], camera[k]);
+            }
         }
-        // Wait for thread to finish running, then add cloud to stitched cloud
-        for (int i = 0; i < NUM_CAMERAS; i++)
+
+        for (int t = 0; t < num_threads; t++)
         {
-            pcs_thread[i]->join();
-            *stitched_cloud += *cloud_ptr[i];
+            for (uint32_t k : buckets[t][shard])
+            {
+                if (best[keys[k]].second != camera[k])
+                {
+                    keep[k] = 0;
+                    removed++;
+                }
+            }
         }
+    }
+
+    size_t count = 0;
+    for (size_t k = 0; k < n; k++)
+    {
+        if (keep[k])
+            stitched_cloud->points[count++] = stitched_cloud->points[k];
+    }
+    stitched_cloud->points.resize(count);
+    stitched_cloud->width = count;
+    stitched_cloud->height = 1;
+
+    if (timer)
+    {
+        timePoint dedup_end = std::chrono::high_resolution_clock::now();
+        std::cout << "Dedup: removed " << removed << " of " << n << " points in "
+                  << timeMilli(dedup_end - dedup_start).count() << " ms" << std::endl;
+    }
+}
+
+// Runs on a camera's receive thread once its transformed cloud is ready:
+// logs the camera's statistics and fuses the cloud.
+void cameraDone(int index, const pointCloudXYZRGB &cloud)
+{
+    const pcs::CameraStats &stats = stitcher->camera(index).stats;
+    noteQuality(index, stats.quality);
+
+    if (timer)
+    {
+        std::cout << "updateCloud " << index << ": " << stats.decode_ms << " ms" << std::endl;
+        if (!shm_name[index].empty())
+            std::cout << "Shared memory " << index << ": frame " << stats.frames << ", "
+                      << stats.dropped << " torn frames dropped" << std::endl;
+        else if (udp)
+            std::cout << "UDP " << index << ": " << stats.partial_frames << "/" << stats.frames
+                      << " partial frames, " << stats.lost_chunks << " lost chunks" << std::endl;
+        std::cout << "Page faults " << index << ": " << stats.minor_faults << " minor, "
+                  << stats.major_faults << " major, " << stats.total_faults << " total" << std::endl;
+    }
+
+    if (fusion)
+        integrateCloud(index, cloud);
+}
+
+// Runs once a frame's camera clouds are merged, before the sinks.
+void processFrame(pcs::StitchedFrame &frame)
+{
+    if (dedup && !fusion)
+        removeDuplicatePoints(frame.cloud, frame.camera_offsets);
 
+    // Hand this frame's clouds to the refinement thread; the stitcher starts
+    // fresh ones for the cameras whose clouds are held
+    if (refine && refine_wanted.exchange(false))
+    {
+        for (int i = 0; i < num_cameras; i++)
+            refine_snapshot[i] = frame.cameras[i];
+        refine_snapshot_ready = true;
+    }
+
+    if (fusion)
+    {
+        extractFusedCloud(frame.cloud);
         if (timer)
-            stitch_end_viewer_start = std::chrono::high_resolution_clock::now();
+            std::cout << "Fused voxels: " << frame.cloud->size() << " (" << fusion_dropped << " points dropped)" << std::endl;
+    }
+}
+
+// Downsampled cloud used by the refinement: one centroid (and for targets
+// a normal) per voxel, with a hash for correspondence lookup.
+struct refineCloud
+{
+    std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f>> points;
+    std::vector<Eigen::Vector3f, Eigen::aligned_allocator<Eigen::Vector3f>> normals;
+    std::unordered_map<uint64_t, int> voxels;
+};
+
+// Averages the points of each voxel. If normals are requested, the normal
+// of a voxel is the least-variance direction of its points. The cloud is
+// taken as it is, already transformed by the stitcher.
+void downsampleForRefinement(const pointCloudXYZRGB &cloud, float size, bool with_normals, refineCloud &out)
+{
+    const float inv_size = 1.0f / size;
+    std::unordered_map<uint64_t, int> index;
+    std::vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d>> sum;
+    std::vector<Eigen::Matrix3d, Eigen::aligned_allocator<Eigen::Matrix3d>> sum_sq;
+    std::vector<int> count;
+
+    for (const auto &p : cloud.points)
+    {
+        if (!std::isfinite(p.x) || (p.x == 0 && p.y == 0 && p.z == 0))
+            continue;
+
+        Eigen::Vector3f q = p.getVector3fMap();
+        uint64_t key = voxelKey(q.x(), q.y(), q.z(), inv_size);
+
+        auto it = index.find(key);
+        int v;
+        if (it == index.end())
+        {
+            v = sum.size();
+            index.emplace(key, v);
+            sum.push_back(Eigen::Vector3d::Zero());
+            sum_sq.push_back(Eigen::Matrix3d::Zero());
+            count.push_back(0);
+        }
+        else
+            v = it->second;
+
+        Eigen::Vector3d qd = q.cast<double>();
+        sum[v] += qd;
+        if (with_normals)
+            sum_sq[v] += qd * qd.transpose();
+        count[v]++;
+    }
+
+    for (auto &entry : index)
+    {
+        int v = entry.second;
+        if (with_normals && count[v] < REFINE_MIN_VOXEL_POINTS)
+            continue;
+
+        Eigen::Vector3d mean = sum[v] / count[v];
+        out.voxels.emplace(entry.first, out.points.size());
+        out.points.push_back(mean.cast<float>());
+
+        if (with_normals)
+        {
+            Eigen::Matrix3d cov = sum_sq[v] / count[v] - mean * mean.transpose();
+            Eigen::SelfAdjointEigenSolver<Eigen::Matrix3d> solver(cov);
+            out.normals.push_back(solver.eigenvectors().col(0).cast<float>());
+        }
+    }
+}
+
+// Point-to-plane ICP of a source onto a target, both already in the world
+// frame. Correspondences are the nearest target voxel among the 27 around
+// each source point. Returns the world-frame correction and the RMS error,
+// or false if the clouds do not overlap enough.
+bool alignPointToPlane(const refineCloud &source, const refineCloud &target, Eigen::Matrix4f &correction, double &rms)
+{
+    const float inv_size = 1.0f / refine_voxel_size;
+    const float max_dist2 = 4 * refine_voxel_size * refine_voxel_size;
+    correction = Eigen::Matrix4f::Identity();
+
+    for (int iter = 0; iter < REFINE_ITERATIONS; iter++)
+    {
+        Eigen::Matrix<double, 6, 6> ata = Eigen::Matrix<double, 6, 6>::Zero();
+        Eigen::Matrix<double, 6, 1> atb = Eigen::Matrix<double, 6, 1>::Zero();
+        double error = 0;
+        long matches = 0;
 
-        // Update the pointcloud visualizer
-        if (visual)
+        #pragma omp parallel
         {
-            if (!i)
+            Eigen::Matrix<double, 6, 6> local_ata = Eigen::Matrix<double, 6, 6>::Zero();
+            Eigen::Matrix<double, 6, 1> local_atb = Eigen::Matrix<double, 6, 1>::Zero();
+            double local_error = 0;
+            long local_matches = 0;
+
+            #pragma omp for schedule(static) nowait
+            for (size_t k = 0; k < source.points.size(); k++)
             {
-                viewer->addPointCloud<pcl::PointXYZRGB>(stitched_cloud, cloud_handler, "cloud");
-                viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 2, "cloud");
+                Eigen::Vector3f p = correction.topLeftCorner<3, 3>() * source.points[k] + correction.topRightCorner<3, 1>();
+
+                int best = -1;
+                float best_dist2 = max_dist2;
+                for (int dx = -1; dx <= 1; dx++)
+                    for (int dy = -1; dy <= 1; dy++)
+                        for (int dz = -1; dz <= 1; dz++)
+                        {
+                            auto it = target.voxels.find(voxelKey(p.x() + dx * refine_voxel_size, p.y() + dy * refine_voxel_size,
+                                                                  p.z() + dz * refine_voxel_size, inv_size));
+                            if (it == target.voxels.end())
+                                continue;
+                            float d2 = (target.points[it->second] - p).squaredNorm();
+                            if (d2 < best_dist2)
+                            {
+                                best_dist2 = d2;
+                                best = it->second;
+                            }
+                        }
+
+                if (best < 0)
+                    continue;
+
+                // Linearized residual n . (p + w x p + t - q)
+                Eigen::Vector3d pd = p.cast<double>();
+                Eigen::Vector3d n = target.normals[best].cast<double>();
+                double r = n.dot(pd - target.points[best].cast<double>());
+                Eigen::Matrix<double, 6, 1> j;
+                j << pd.cross(n), n;
+
+                local_ata += j * j.transpose();
+                local_atb -= j * r;
+                local_error += r * r;
+                local_matches++;
             }
-            else
-                viewer->updatePointCloud(stitched_cloud, "cloud");
 
-            viewer->spinOnce();
-            i++;
+            #pragma omp critical
+            {
+                ata += local_ata;
+                atb += local_atb;
+                error += local_error;
+                matches += local_matches;
+            }
+        }
+
+        if (matches < REFINE_MIN_MATCHES)
+            return false;
+
+        rms = std::sqrt(error / matches);
+        Eigen::Matrix<double, 6, 1> x = ata.ldlt().solve(atb);
 
-            if (viewer->wasStopped())
+        Eigen::Matrix4f step = Eigen::Matrix4f::Identity();
+        step.topLeftCorner<3, 3>() = (Eigen::AngleAxisd(x(2), Eigen::Vector3d::UnitZ()) *
+                                      Eigen::AngleAxisd(x(1), Eigen::Vector3d::UnitY()) *
+                                      Eigen::AngleAxisd(x(0), Eigen::Vector3d::UnitX())).toRotationMatrix().cast<float>();
+        step.topRightCorner<3, 1>() = x.tail<3>().cast<float>();
+        correction = step * correction;
+
+        if (x.norm() < 1e-6)
+            break;
+    }
+
+    return true;
+}
+
+// Background refinement (-R). Every refine_period seconds it takes the
+// latest per-camera clouds from the stitching loop and aligns each camera to
+// the others, keeping the reference camera fixed. Corrections that are too
+// large to be mount drift are rejected. The stitching loop only hands over
+// cloud pointers, so refinement never blocks frame ingestion.
+void refineLoop()
+{
+    pinThread(ROLE_COMPUTE);
+
+    while (1)
+    {
+        std::this_thread::sleep_for(std::chrono::milliseconds(int(refine_period * 1000)));
+
+        // Ask the stitching loop for its next frame and wait for it
+        refine_snapshot_ready = false;
+        refine_wanted = true;
+        while (!refine_snapshot_ready)
+            std::this_thread::sleep_for(std::chrono::milliseconds(5));
+
+        timePoint refine_start = std::chrono::high_resolution_clock::now();
+
+        std::vector<refineCloud> clouds(num_cameras);
+        #pragma omp parallel for schedule(dynamic)
+        for (int i = 0; i < num_cameras; i++)
+            downsampleForRefinement(*refine_snapshot[i], refine_voxel_size, true, clouds[i]);
+
+        for (int i = 0; i < num_cameras; i++)
+        {
+            if (i == REFINE_REFERENCE_CAMERA)
+                continue;
+
+            // Target is every other camera, source is this camera's voxels
+            refineCloud target;
+            for (int j = 0; j < num_cameras; j++)
+            {
+                if (j == i)
+                    continue;
+                for (auto &entry : clouds[j].voxels)
+                {
+                    if (target.voxels.emplace(entry.first, target.points.size()).second)
+                    {
+                        target.points.push_back(clouds[j].points[entry.second]);
+                        target.normals.push_back(clouds[j].normals[entry.second]);
+                    }
+                }
+            }
+
+            Eigen::Matrix4f correction;
+            double rms;
+            if (!alignPointToPlane(clouds[i], target, correction, rms))
+            {
+                std::cout << "Refine " << i << ": not enough overlap" << std::endl;
+                continue;
+            }
+
+            float shift = correction.topRightCorner<3, 1>().norm();
+            float angle = Eigen::AngleAxisf(Eigen::Matrix3f(correction.topLeftCorner<3, 3>())).angle();
+            if (shift > REFINE_MAX_SHIFT || angle > REFINE_MAX_ANGLE)
             {
-                exit(0);
+                std::cout << "Refine " << i << ": rejected correction of " << shift * 100 << " cm, "
+                          << angle * 180 / M_PI << " deg" << std::endl;
+                continue;
             }
+
+            // Apply the correction on top of whatever transform is live now
+            setTransform(i, correction * currentTransform(i));
+            std::cout << "Refine " << i << ": moved " << shift * 1000 << " mm, " << angle * 180 / M_PI
+                      << " deg, RMS " << rms * 1000 << " mm" << std::endl;
         }
 
+        for (int i = 0; i < num_cameras; i++)
+            refine_snapshot[i].reset();
+
+        timePoint refine_end = std::chrono::high_resolution_clock::now();
+        std::cout << "Refine: " << timeMilli(refine_end - refine_start).count() << " ms" << std::endl;
+    }
+}
+
+// Primary function to update the pointcloud viewer with an XYZRGB pointcloud.
+#ifndef PCS_HEADLESS
+pcl::visualization::PCLVisualizer::Ptr viewer;
+#endif
+
+// Opens the viewer window. Only called with -v, so VTK is never initialized
+// on headless runs; headless builds do not link the viewer at all.
+void initViewer()
+{
+#ifndef PCS_HEADLESS
+    viewer = pcl::visualization::PCLVisualizer::Ptr(new pcl::visualization::PCLVisualizer("3D Viewer"));
+    viewer->setBackgroundColor(0.05, 0.05, 0.05, 0);
+#endif
+}
+
+// Shows the level of detail of the current frame that fits the viewer's
+// budget. Returns false once the window was closed.
+bool updateViewer()
+{
+#ifndef PCS_HEADLESS
+    static bool added = false;
+    pointCloudXYZRGB::Ptr view_cloud = lodForBudget(lod_budget);
+    pcl::visualization::PointCloudColorHandlerRGBField<pcl::PointXYZRGB> view_handler(view_cloud);
+
+    if (!added)
+    {
+        viewer->addPointCloud<pcl::PointXYZRGB>(view_cloud, view_handler, "cloud");
+        viewer->setPointCloudRenderingProperties(pcl::visualization::PCL_VISUALIZER_POINT_SIZE, 2, "cloud");
+        added = true;
+    }
+    else
+        viewer->updatePointCloud<pcl::PointXYZRGB>(view_cloud, view_handler, "cloud");
+
+    viewer->spinOnce();
+    return !viewer->wasStopped();
+#else
+    return true;
+#endif
+}
+
+// Stitching throughput, printed once per second
+struct stitchStats
+{
+    timePoint window_start = std::chrono::high_resolution_clock::now();
+    long frames = 0;
+    long points_in = 0;     // Points received from the cameras
+    long points_out = 0;    // Points in the stitched cloud
+};
+
+stitchStats stitch_stats;
+
+void printStitchStats()
+{
+    double elapsed = timeMilli(std::chrono::high_resolution_clock::now() - stitch_stats.window_start).count();
+    if (elapsed < 1000.0 || !stitch_stats.frames)
+        return;
+
+    std::cout << "Throughput: " << stitch_stats.frames * 1000.0 / elapsed << " FPS, "
+              << stitch_stats.points_in / (elapsed * 1000.0) << " Mpoints/s in, "
+              << stitch_stats.points_out / (elapsed * 1000.0) << " Mpoints/s stitched" << std::endl;
+
+    stitch_stats = stitchStats();
+}
+
+void runStitching()
+{
+    double total = 0;
+    pcs::StitchedFrame frame;
+
+    if (visual)
+        initViewer();
+
+    // Loop until the visualizer is stopped
+    while (1)
+    {
+        // Let go of the last frame, so the stitcher reuses its cloud
+        lod_levels[0].reset();
+        stitcher->next(frame);
+
+        beginLod(frame.cloud);
+        if (publish_port)
+            publishFrame();
+        if (query_port)
+            buildSpatialIndex(*frame.cloud);
+
+        // Update the pointcloud visualizer; saved frames still get the full cloud
+        if (visual && !updateViewer())
+            exit(0);
+
+        stitch_stats.frames++;
+        for (const auto &cloud : frame.cameras)
+            stitch_stats.points_in += cloud->size();
+        stitch_stats.points_out += frame.cloud->size();
+        printStitchStats();
+
         if (timer)
         {
-            double temp = timeMilli(stitch_end_viewer_start - stitch_start).count();
-            total += temp;
+            total += frame.stitch_ms;
             std::cout << "Stitch average: " << total / loop_count << " ms" << std::endl;
+            printRoleUsage();
             loop_count++;
         }
-
-        if (save)
-        {
-            std::string filename("pointclouds/stitched_cloud_" + std::to_string(framecount) + ".ply");
-            pcl::io::savePLYFileBinary(filename, *stitched_cloud);
-            std::cout << "Saved frame " << framecount << std::endl;
-            framecount++;
-            if (framecount == 20)
-                save = false;
-        }
     }
 }
 
 int main(int argc, char **argv)
 {
 
+    std::fill(numa_node, numa_node + MAX_CAMERAS, -1);
     parseArgs(argc, argv);
 
+    // The main thread stitches and renders; the OpenMP workers get one compute CPU each
+    printAffinity();
+    pinThread(ROLE_RENDER);
+    pinComputeTeam(omp_get_max_threads());
+
     stitched_buf = (short *)malloc(sizeof(short) * STITCHED_BUF_SIZE);
 
     /* Reminder: how transformation matrices work :
@@ -374,16 +1792,94 @@ int main(int argc, char **argv)
         -0.7990649367483048, 0.09413689665091773, 0.5938294970345968, 0.42644689416334686,
         0.0, 0.0, 0.0, 1.0;
 
-    for (int i = 0; i < NUM_CAMERAS; i++)
+    try
     {
-        initSocket(SERVER_PORT, IP_ADDRESS[i], i);
-    }
+        // Each camera is received on its own pinned thread
+        pcs::StitcherOptions options;
+        options.downsample = downsample;
+        options.accumulate = !clean;
+        options.merge = !fusion;
+        options.thread_start = [](int index) { pinThread(ROLE_RECEIVER, index); };
+        options.camera_done = cameraDone;
+        options.process = processFrame;
+        stitcher.reset(new pcs::Stitcher(options));
+
+        // A multi-camera edge server multiplexes its cameras on one connection
+        std::vector<std::unique_ptr<pcs::CameraStream>> edge_streams;
+        if (!edge_node.empty())
+        {
+            pcs::StreamOptions stream_options;
+            stream_options.numa_node = numa_node[0];
+            stream_options.lock_memory = lock_memory;
+            stream_options.background = !foreground_only;
+            edge_streams = pcs::CameraStream::connectAll(edge_node, SERVER_PORT, stream_options);
+            if (edge_streams.empty() || edge_streams.size() > MAX_CAMERAS)
+                throw std::runtime_error(edge_node + " streams " + std::to_string(edge_streams.size()) + " cameras, expected 1 to " +
+                                         std::to_string(MAX_CAMERAS));
+            num_cameras = edge_streams.size();
+        }
+
+        // Only the first two cameras have built-in transforms
+        if (calibration_file.empty() && num_cameras > 2)
+            throw std::runtime_error("Stitching " + std::to_string(num_cameras) +
+                                     " cameras needs their transforms, give them with -k");
+
+        if (!calibration_file.empty())
+        {
+            for (int i = 0; i < num_cameras; i++)
+            {
+                float mat[16];
+                if (!loadCalibration(calibration_file, i, mat))
+                {
+                    std::cerr << "No transform for camera " << i << " in " << calibration_file << std::endl;
+                    exit(EXIT_FAILURE);
+                }
+                transform[i] = Eigen::Map<Eigen::Matrix<float, 4, 4, Eigen::RowMajor>>(mat);
+            }
+            std::cout << "Loaded camera transforms from " << calibration_file << std::endl;
+        }
+
+        for (int i = 0; i < num_cameras; i++)
+        {
+            pcs::StreamOptions stream_options;
+            stream_options.numa_node = numa_node[i];
+            stream_options.lock_memory = lock_memory;
+            stream_options.background = !foreground_only;
+
+            if (!edge_streams.empty())
+                stitcher->addCamera(std::move(edge_streams[i]), transform[i]);
+            else if (!shm_name[i].empty())
+                stitcher->addCamera(pcs::CameraStream::attach(shm_name[i]), transform[i]);
+            else if (udp)
+                stitcher->addCamera(pcs::CameraStream::listen(SERVER_PORT + i, udp_group, stream_options), transform[i]);
+            else
+                stitcher->addCamera(pcs::CameraStream::connect(IP_ADDRESS[i], SERVER_PORT, stream_options), transform[i]);
+        }
+
+        if (save)
+            stitcher->addSink(std::make_shared<pcs::PlySink>("pointclouds/stitched_cloud_", 20));
 
-    signal(SIGINT, sigintHandler);
+        signal(SIGINT, sigintHandler);
 
-    runStitching();
+        if (fusion)
+            initFusion();
 
-    close(sockfd_array[0]);
+        if (refine)
+            std::thread(refineLoop).detach();
+
+        if (publish_port)
+            initPublisher(publish_port);
+
+        if (query_port)
+            initQueryServer(query_port);
+
+        runStitching();
+    }
+    catch (const std::exception &e)
+    {
+        std::cerr << e.what() << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
     close(server_sockfd);
     close(client_sockfd);
@@ -0,0 +1,56 @@
+/*
+ * pcs-profiles.h
+ *
+ * Named capture profiles for the RealSense streams. The depth resolution
+ * fixes the number of points per frame, and with it every buffer size and
+ * downstream cost, so it is chosen explicitly instead of left to the
+ * device defaults.
+ */
+
+#ifndef PCS_PROFILES_H
+#define PCS_PROFILES_H
+
+#include <librealsense2/rs.hpp>
+
+#include <cstring>
+#include <iostream>
+
+struct captureProfile {
+    const char *name;
+    int depth_width, depth_height, depth_fps;
+    int color_width, color_height, color_fps;
+};
+
+// The color sensor tops out at 60 FPS, so the low latency profile pairs
+// 90 FPS depth with 60 FPS color.
+const captureProfile CAPTURE_PROFILES[] = {
+    {"low-latency", 424, 240, 90,  424, 240, 60},
+    {"balanced",    640, 480, 30,  640, 480, 30},
+    {"full",       1280, 720, 30, 1280, 720, 30},
+    {"record",     1280, 720, 30, 1920, 1080, 30},
+};
+
+const int NUM_CAPTURE_PROFILES = sizeof(CAPTURE_PROFILES) / sizeof(CAPTURE_PROFILES[0]);
+
+// Returns the profile with the given name, or NULL.
+inline const captureProfile *findCaptureProfile(const char *name) {
+    for (int i = 0; i < NUM_CAPTURE_PROFILES; i++) {
+        if (strcmp(CAPTURE_PROFILES[i].name, name) == 0) return &CAPTURE_PROFILES[i];
+    }
+    return NULL;
+}
+
+inline void printCaptureProfiles() {
+    for (int i = 0; i < NUM_CAPTURE_PROFILES; i++) {
+        const captureProfile &p = CAPTURE_PROFILES[i];
+        std::cout << "  " << p.name << ": depth " << p.depth_width << "x" << p.depth_height << "@" << p.depth_fps
+                  << ", color " << p.color_width << "x" << p.color_height << "@" << p.color_fps << std::endl;
+    }
+}
+
+inline void enableCaptureProfile(rs2::config &cfg, const captureProfile *p) {
+    cfg.enable_stream(RS2_STREAM_DEPTH, p->depth_width, p->depth_height, RS2_FORMAT_Z16, p->depth_fps);
+    cfg.enable_stream(RS2_STREAM_COLOR, p->color_width, p->color_height, RS2_FORMAT_RGB8, p->color_fps);
+}
+
+#endif
@@ -0,0 +1,105 @@
+/*
+ * pcs-protocol.h
+ *
+ * Handshake and framing of the TCP transport. Right after accepting the
+ * central computer's connection, the edge server announces its stream so
+ * the receiver can allocate its buffers once, at the size frames can
+ * actually reach, and reject anything larger. Every frame then starts
+ * with a frameHeader.
+ *
+ * An edge server driving several cameras multiplexes them on the one
+ * connection. The handshake gives the number of cameras, each pull request
+ * is answered with one frame per camera in camera order, and every frame
+ * header names its camera.
+ *
+ * An edge server that removes the static background sends only the
+ * foreground of each frame, flagged FRAME_FOREGROUND. Now and then the
+ * foreground frame of a camera is preceded by a FRAME_BACKGROUND frame
+ * holding the points it left out, which the receiver keeps and merges into
+ * that camera's following foreground frames.
+ *
+ * The central computer republishes the stitched cloud the same way. A
+ * subscriber connects, sends a subscribeRequest and then receives a
+ * publishHeader and the points (five shorts each, as from the edge) for
+ * every frame, at the level of detail, crop and compression it asked for.
+ *
+ * Spatial queries against the latest stitched frame use a request/reply
+ * connection: each queryRequest is answered by a queryReply followed by
+ * the matching points, five shorts each. A request with a wrong magic or a
+ * NaN or infinite coordinate closes the connection.
+ */
+
+#ifndef PCS_PROTOCOL_H
+#define PCS_PROTOCOL_H
+
+#include <stdint.h>
+
+#define STREAM_MAGIC        0x50435354  // "PCST"
+#define STREAM_VERSION      4
+#define POINT_BYTES         (5 * sizeof(short))
+#define PUBLISH_MAGIC       0x50435350  // "PCSP"
+#define QUERY_MAGIC         0x50435351  // "PCSQ"
+
+#define FRAME_FOREGROUND    0x01        // Background removed; merge the last background refresh
+#define FRAME_BACKGROUND    0x02        // Background refresh, ahead of the camera's frame
+
+enum queryType { QUERY_BOX = 1, QUERY_RADIUS = 2, QUERY_NEAREST = 3 };
+
+struct __attribute__((packed)) streamHeader {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t max_points;    // Largest number of points a frame of any camera can carry
+    uint16_t width;         // Depth stream geometry of the first camera, informational
+    uint16_t height;
+    uint16_t fps;
+    uint16_t cameras;       // Cameras multiplexed on the connection
+};
+
+struct __attribute__((packed)) frameHeader {
+    int32_t size;           // Payload bytes
+    uint8_t quality;        // Adaptive quality level, 0 is full quality
+    uint8_t stride;         // Every stride-th point was kept
+    uint16_t max_range;     // Range the points were cropped to in cm, 0 for none
+    uint8_t camera;         // Index of the camera on its edge server
+    uint8_t flags;          // FRAME_FOREGROUND, FRAME_BACKGROUND
+    uint8_t reserved[2];
+};
+
+struct __attribute__((packed)) subscribeRequest {
+    uint32_t magic;
+    uint8_t lod;            // Pyramid level, 0 for full resolution
+    uint8_t compression;    // zlib level 1-9, 0 for raw points
+    uint16_t reserved;
+    float crop_min[3];      // Box in the stitched frame, in m; min > max disables the crop
+    float crop_max[3];
+};
+
+struct __attribute__((packed)) queryRequest {
+    uint32_t magic;
+    uint8_t type;           // queryType
+    uint8_t reserved;
+    uint16_t k;             // Neighbors for QUERY_NEAREST
+    float a[3];             // Box min, sphere center or query point, in m
+    float b[3];             // Box max, or the radius in b[0]
+    uint32_t max_points;    // Limit of returned points, 0 for all
+};
+
+struct __attribute__((packed)) queryReply {
+    uint32_t magic;
+    uint32_t frame_id;      // Stitched frame the index was built from
+    uint32_t num_points;
+    float micros;           // Time spent in the index
+};
+
+struct __attribute__((packed)) publishHeader {
+    uint32_t magic;
+    uint32_t frame_id;
+    uint32_t num_points;
+    uint32_t raw_bytes;     // Size of the points before compression
+    uint32_t size;          // Payload bytes that follow
+    uint8_t lod;
+    uint8_t compression;    // 0 if the payload is raw points
+    uint16_t reserved;
+};
+
+#endif
@@ -0,0 +1,170 @@
+/*
+ * pcs-shm.h
+ *
+ * Shared-memory transport between an edge server and a consumer on the
+ * same machine. The edge server packs points straight into a POSIX shm
+ * ring of fixed-size frame slots and wakes readers through a futex on the
+ * publish counter; readers convert the points in place, so a frame never
+ * goes through the kernel.
+ *
+ * The writer never waits for readers. Each slot is guarded by a sequence
+ * lock: a reader that was lapped by the writer sees the slot sequence
+ * change and drops the frame instead of using torn data.
+ */
+
+#ifndef PCS_SHM_H
+#define PCS_SHM_H
+
+#include <stdint.h>
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+#define SHM_MAGIC       0x50435353  // "PCSS"
+#define SHM_SLOTS       4
+#define SHM_SLOT_ALIGN  4096
+
+struct shmSlot {
+    uint32_t seq;           // Odd while the writer fills the slot
+    uint32_t frame_id;
+    uint32_t num_points;
+    uint32_t quality;       // Adaptive quality level of the frame
+};
+
+struct shmRing {
+    uint32_t magic;
+    uint32_t num_slots;
+    uint64_t slot_bytes;    // Payload capacity of each slot
+    uint32_t published;     // Frames published so far, also the futex word
+    uint32_t reserved;
+};
+
+struct shmHandle {
+    shmRing *ring;
+    size_t map_size;
+    uint32_t last_read;     // Reader side: last frame consumed
+};
+
+inline size_t shmSlotStride(uint64_t slot_bytes) {
+    return ((sizeof(shmSlot) + slot_bytes + SHM_SLOT_ALIGN - 1) / SHM_SLOT_ALIGN) * SHM_SLOT_ALIGN;
+}
+
+inline shmSlot *shmGetSlot(shmRing *ring, uint32_t index) {
+    char *base = (char *)ring + SHM_SLOT_ALIGN;
+    return (shmSlot *)(base + (index % ring->num_slots) * shmSlotStride(ring->slot_bytes));
+}
+
+inline short *shmSlotData(shmSlot *slot) {
+    return (short *)(slot + 1);
+}
+
+// Creates (or recreates) the ring as the writer. Returns false on failure.
+inline bool shmCreate(shmHandle *h, const char *name, uint64_t slot_bytes) {
+    shm_unlink(name);
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0666);
+    if (fd < 0) return false;
+
+    h->map_size = SHM_SLOT_ALIGN + SHM_SLOTS * shmSlotStride(slot_bytes);
+    if (ftruncate(fd, h->map_size) < 0) {
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(NULL, h->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    h->ring = (shmRing *)mem;
+    memset(h->ring, 0, sizeof(shmRing));
+    h->ring->num_slots = SHM_SLOTS;
+    h->ring->slot_bytes = slot_bytes;
+    h->last_read = 0;
+    __atomic_store_n(&h->ring->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+    return true;
+}
+
+// Maps an existing ring as a reader. Returns false if the writer has not
+// created it yet.
+inline bool shmAttach(shmHandle *h, const char *name) {
+    int fd = shm_open(name, O_RDWR, 0666);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size < SHM_SLOT_ALIGN) {
+        close(fd);
+        return false;
+    }
+
+    void *mem = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) return false;
+
+    h->ring = (shmRing *)mem;
+    h->map_size = st.st_size;
+    if (__atomic_load_n(&h->ring->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC) {
+        munmap(mem, st.st_size);
+        return false;
+    }
+    h->last_read = __atomic_load_n(&h->ring->published, __ATOMIC_ACQUIRE);
+    return true;
+}
+
+// Writer: returns the slot the next frame should be packed into.
+inline short *shmBeginWrite(shmHandle *h) {
+    shmSlot *slot = shmGetSlot(h->ring, h->ring->published);
+    __atomic_add_fetch(&slot->seq, 1, __ATOMIC_ACQ_REL);
+    return shmSlotData(slot);
+}
+
+// Writer: publishes the slot filled since shmBeginWrite and wakes readers.
+inline void shmPublish(shmHandle *h, uint32_t num_points, uint32_t quality = 0) {
+    uint32_t frame = h->ring->published;
+    shmSlot *slot = shmGetSlot(h->ring, frame);
+    slot->frame_id = frame;
+    slot->num_points = num_points;
+    slot->quality = quality;
+    __atomic_add_fetch(&slot->seq, 1, __ATOMIC_RELEASE);
+    __atomic_store_n(&h->ring->published, frame + 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &h->ring->published, FUTEX_WAKE, INT32_MAX, NULL, NULL, 0);
+}
+
+// Reader: waits up to timeout_ms for a frame newer than the last one read
+// and returns its slot, skipping frames the reader fell behind on. The
+// slot sequence is stored in *seq for shmValidate. Returns NULL on timeout.
+inline shmSlot *shmWaitFrame(shmHandle *h, int timeout_ms, uint32_t *seq) {
+    struct timespec ts = {timeout_ms / 1000, (timeout_ms % 1000) * 1000000L};
+
+    while (1) {
+        uint32_t published = __atomic_load_n(&h->ring->published, __ATOMIC_ACQUIRE);
+        if (published != h->last_read) {
+            shmSlot *slot = shmGetSlot(h->ring, published - 1);
+            *seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+            h->last_read = published;
+            if (*seq & 1) continue;     // Already being rewritten
+            return slot;
+        }
+
+        if (syscall(SYS_futex, &h->ring->published, FUTEX_WAIT, published, &ts, NULL, 0) < 0 &&
+            errno == ETIMEDOUT)
+            return NULL;
+    }
+}
+
+// Reader: true if the slot was not rewritten while it was being read.
+inline bool shmValidate(shmSlot *slot, uint32_t seq) {
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    return __atomic_load_n(&slot->seq, __ATOMIC_RELAXED) == seq;
+}
+
+inline void shmClose(shmHandle *h) {
+    if (h->ring) munmap(h->ring, h->map_size);
+    h->ring = NULL;
+}
+
+#endif
@@ -0,0 +1,874 @@
+/*
+ * pcs-stitch.cpp
+ *
+ * Implementation of libpcs, see pcs-stitch.h. The camera streams read into
+ * receive buffers from a pre-faulted arena, so the per-frame path neither
+ * allocates nor faults.
+ */
+
+#include "pcs-stitch.h"
+
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string.h>
+#include <iostream>
+#include <chrono>
+#include <stdexcept>
+#include <algorithm>
+#include <omp.h>
+
+#include <pcl/common/transforms.h>
+#include <pcl/io/ply_io.h>
+
+#include "pcs-udp.h"
+#include "pcs-shm.h"
+#include "pcs-protocol.h"
+#include "pcs-arena.h"
+
+namespace pcs {
+
+typedef std::chrono::high_resolution_clock clockTime;
+typedef std::chrono::time_point<clockTime> timePoint;
+typedef std::chrono::duration<double, std::milli> timeMilli;
+
+const float CONV_RATE = 1000.0;
+const char PULL_XYZRGB = 'Z';
+
+static void fail(const std::string &message)
+{
+    throw std::runtime_error(message);
+}
+
+static void failErrno(const std::string &message)
+{
+    throw std::runtime_error(message + ": " + strerror(errno));
+}
+
+FrameDecoder::FrameDecoder(int downsample, int threads)
+    : downsample(std::max(1, downsample)), threads(std::max(1, threads))
+{
+}
+
+void FrameDecoder::decode(const short *buffer, int points, pointCloudXYZRGB &cloud,
+                          const short *extra, int extra_points) const
+{
+    const int total = points + (extra ? extra_points : 0);
+    const int count = (total + downsample - 1) / downsample;
+
+    cloud.width = count;
+    cloud.height = 1;
+    cloud.is_dense = false;
+    cloud.points.resize(count);
+
+    #pragma omp parallel for schedule(static) num_threads(threads) if (threads > 1)
+    for (int k = 0; k < count; k++)
+    {
+        const size_t i = (size_t)k * downsample;
+        const short *p = i < (size_t)points ? &buffer[i * 5] : &extra[(i - points) * 5];
+        pcl::PointXYZRGB &q = cloud.points[k];
+        q.x = (float)p[0] / CONV_RATE;
+        q.y = (float)p[1] / CONV_RATE;
+        q.z = (float)p[2] / CONV_RATE;
+        q.r = (uint8_t)(p[3] & 0xFF);
+        q.g = (uint8_t)(p[3] >> 8);
+        q.b = (uint8_t)(p[4] & 0xFF);
+    }
+}
+
+// Receive buffer of a socket stream, allocated once from a pre-faulted huge
+// page arena on the requested NUMA node.
+class bufferedStream : public CameraStream
+{
+public:
+    ~bufferedStream()
+    {
+        arenaDestroy(&arena);
+    }
+
+    void close() override
+    {
+        closed = true;
+        shutdown(sockfd, SHUT_RDWR);
+    }
+
+protected:
+    void allocate(int points, const StreamOptions &options)
+    {
+        if (!arenaCreate(&arena, sizeof(short) * 5 * points, options.numa_node, options.lock_memory))
+            failErrno("Receive buffer allocation failed for " + stream_name);
+
+        buffer = (short *)arenaAlloc(&arena, sizeof(short) * 5 * points);
+        capacity = points;
+        std::cout << stream_name << " receive buffer: " << capacity << " points, "
+                  << float(arena.size) / (1 << 20) << " MBytes of " << arenaPageType(&arena)
+                  << (arena.node >= 0 ? " on node " + std::to_string(arena.node) : "")
+                  << (arena.locked ? ", locked" : "") << std::endl;
+    }
+
+    int sockfd = -1;
+    frameArena arena;
+    short *buffer = nullptr;
+    int capacity = 0;           // Points buffer can hold
+};
+
+class tcpStream;
+
+// TCP connection to a camera server, shared by the streams of its cameras.
+// Each pull request is answered with one frame per camera, and the frames
+// are routed to their stream by the camera index in their header. The next
+// round is pulled as soon as the last frame of one has been read, so the
+// edge packs it while this one is decoded.
+class tcpConnection
+{
+public:
+    tcpConnection(const std::string &ip, int port)
+    {
+        name = ip + ":" + std::to_string(port);
+
+        struct sockaddr_in serv_addr;
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_port = htons(port);
+        serv_addr.sin_addr.s_addr = inet_addr(ip.c_str());
+
+        if ((sockfd = socket(AF_INET, SOCK_STREAM, 0)) < 0)
+            failErrno("Couldn't create socket");
+
+        if (::connect(sockfd, (struct sockaddr *)&serv_addr, sizeof(serv_addr)) < 0)
+        {
+            ::close(sockfd);
+            fail("Connection failed at " + ip + ".");
+        }
+        std::cout << "Connection made at " << name << std::endl;
+
+        // The server announces its frame capacity before the first pull request
+        readNBytes(sizeof(header), &header);
+        if (header.magic != STREAM_MAGIC || header.version != STREAM_VERSION || header.cameras == 0)
+        {
+            ::close(sockfd);
+            fail(name + " sent no stream handshake");
+        }
+        std::cout << name << " streams " << header.cameras << (header.cameras > 1 ? " cameras, " : " camera, ")
+                  << header.width << " x " << header.height << " @ " << header.fps << " FPS" << std::endl;
+        streams.assign(header.cameras, nullptr);
+    }
+
+    ~tcpConnection()
+    {
+        ::close(sockfd);
+    }
+
+    void close()
+    {
+        closed = true;
+        shutdown(sockfd, SHUT_RDWR);
+    }
+
+    // Reads the next frame into its camera's stream. Called with the mutex
+    // held.
+    void readFrame();
+
+    std::string name;
+    streamHeader header;
+    std::mutex mutex;                   // One reader at a time
+    std::vector<tcpStream *> streams;   // Indexed by camera, null once a stream is gone
+
+private:
+    void sendPullRequest()
+    {
+        char pull_char = PULL_XYZRGB;
+        if (send(sockfd, &pull_char, 1, MSG_NOSIGNAL) < 0)
+            failErrno("Pull request failure at " + name);
+    }
+
+    // Reads exactly n bytes.
+    void readNBytes(size_t n, void *dst)
+    {
+        size_t total_bytes = 0;
+        while (total_bytes < n)
+        {
+            ssize_t bytes_read = read(sockfd, (char *)dst + total_bytes, n - total_bytes);
+            if (bytes_read < 1)
+            {
+                if (bytes_read < 0 && errno == EINTR && !closed)
+                    continue;
+                fail("Receive failure at " + name);
+            }
+            total_bytes += bytes_read;
+        }
+    }
+
+    // Discards n bytes of the stream, keeping it framed after a rejected frame.
+    void skipNBytes(size_t n)
+    {
+        char scratch[65536];
+        while (n > 0)
+        {
+            size_t chunk = std::min(n, sizeof(scratch));
+            readNBytes(chunk, scratch);
+            n -= chunk;
+        }
+    }
+
+    int sockfd = -1;
+    std::atomic<bool> closed{false};
+    bool pulled = false;
+    int round_frames = 0;       // Frames of the current round read so far
+};
+
+// One camera of a TCP connection. Its frame is read into its own buffer,
+// by whichever stream of the connection is reading, and held until this
+// stream receives it. The Stitcher receives every camera once per frame,
+// so a held frame is never overwritten. A background refresh is kept in a
+// second buffer, allocated on the first one, and appended to every
+// foreground-only frame that follows.
+class tcpStream : public bufferedStream
+{
+public:
+    tcpStream(std::shared_ptr<tcpConnection> connection, int camera, const StreamOptions &options)
+        : connection(connection), camera_index(camera), merge_background(options.background)
+    {
+        stream_name = connection->name;
+        if (connection->header.cameras > 1)
+            stream_name += "/" + std::to_string(camera);
+
+        allocate(connection->header.max_points, options);
+        connection->streams[camera] = this;
+    }
+
+    ~tcpStream()
+    {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        connection->streams[camera_index] = nullptr;
+    }
+
+    bool receive(const FrameDecoder &decoder, pointCloudXYZRGB &cloud) override
+    {
+        timePoint read_start = clockTime::now();
+        int size;
+        int merged;
+        {
+            std::lock_guard<std::mutex> lock(connection->mutex);
+            while (!ready)
+                connection->readFrame();
+            ready = false;
+            size = frame_size;
+            merged = foreground ? background_points : 0;
+        }
+
+        // Oversized frames were skipped, keep the last cloud
+        if (size < 0)
+            return false;
+
+        timePoint decode_start = clockTime::now();
+        decoder.decode(buffer, size / POINT_BYTES, cloud, merged ? background.data() : nullptr, merged);
+        stats.receive_ms = timeMilli(decode_start - read_start).count();
+        stats.decode_ms = timeMilli(clockTime::now() - decode_start).count();
+        stats.frames++;
+        return true;
+    }
+
+    void close() override
+    {
+        closed = true;
+        connection->close();
+    }
+
+private:
+    friend class tcpConnection;
+
+    std::shared_ptr<tcpConnection> connection;
+    int camera_index;
+    bool ready = false;         // A frame is held in buffer
+    int frame_size = 0;         // Bytes of the held frame, -1 if it was rejected
+    bool foreground = false;    // The held frame has its background removed
+    bool merge_background;
+    std::vector<short> background;  // Last background refresh
+    int background_points = 0;
+};
+
+void tcpConnection::readFrame()
+{
+    if (!pulled)
+    {
+        sendPullRequest();
+        pulled = true;
+    }
+
+    // Read the frame header to determine the size being sent, then read in pointcloud
+    frameHeader frame;
+    readNBytes(sizeof(frame), &frame);
+    int size = frame.size;
+    if (size < 0 || size % POINT_BYTES != 0 || frame.camera >= streams.size())
+        fail("Corrupt frame header from " + name + ": " + std::to_string(size) + " bytes for camera " +
+             std::to_string(frame.camera));
+
+    tcpStream *stream = streams[frame.camera];
+    if (frame.flags & FRAME_BACKGROUND)
+    {
+        // Kept for the camera's foreground frames; the round goes on with
+        // the frame that follows
+        if (stream && stream->merge_background && size <= stream->capacity * (int)POINT_BYTES)
+        {
+            stream->background.resize((size_t)stream->capacity * 5);
+            readNBytes(size, stream->background.data());
+            stream->background_points = size / POINT_BYTES;
+            stream->stats.background_frames++;
+        }
+        else
+        {
+            skipNBytes(size);
+        }
+        return;
+    }
+
+    if (!stream)
+    {
+        skipNBytes(size);
+    }
+    else if (size > stream->capacity * (int)POINT_BYTES)
+    {
+        // Never read past the negotiated capacity; drop the frame
+        skipNBytes(size);
+        std::cerr << stream->name() << ": rejected " << size << " byte frame, "
+                  << ++stream->stats.dropped << " oversized so far" << std::endl;
+        stream->frame_size = -1;
+        stream->ready = true;
+    }
+    else
+    {
+        readNBytes(size, stream->buffer);
+        stream->stats.quality = frame.quality;
+        stream->frame_size = size;
+        stream->foreground = frame.flags & FRAME_FOREGROUND;
+        stream->ready = true;
+    }
+
+    if (++round_frames == (int)streams.size())
+    {
+        round_frames = 0;
+        sendPullRequest();
+    }
+}
+
+// UDP stream of a camera server, reassembled from MTU sized chunks of whole
+// points.
+class udpStream : public bufferedStream
+{
+public:
+    udpStream(int port, const std::string &group, const StreamOptions &options)
+    {
+        stream_name = "UDP port " + std::to_string(port);
+
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(port);
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+
+        if ((sockfd = socket(AF_INET, SOCK_DGRAM, IPPROTO_UDP)) < 0)
+            failErrno("Couldn't create socket");
+
+        // Several consumers on one machine may subscribe to the same group
+        int opt = 1;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt)))
+            perror("setsockopt failed");
+
+        // Hold a few whole frames worth of datagrams
+        int rcvbuf = 16 << 20;
+        if (setsockopt(sockfd, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf)))
+            perror("setsockopt failed");
+
+        if (bind(sockfd, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+        {
+            ::close(sockfd);
+            fail("Bind failed on UDP port " + std::to_string(port) + ".");
+        }
+
+        struct in_addr group_addr;
+        if (inet_pton(AF_INET, group.c_str(), &group_addr) == 1 && IN_MULTICAST(ntohl(group_addr.s_addr)))
+        {
+            struct ip_mreq mreq;
+            mreq.imr_multiaddr = group_addr;
+            mreq.imr_interface.s_addr = htonl(INADDR_ANY);
+            if (setsockopt(sockfd, IPPROTO_IP, IP_ADD_MEMBERSHIP, &mreq, sizeof(mreq)) < 0)
+            {
+                ::close(sockfd);
+                fail("Couldn't join multicast group " + group + ".");
+            }
+        }
+
+        std::cout << "Listening for UDP chunks on port " << port << std::endl;
+        allocate(options.max_points, options);
+    }
+
+    ~udpStream()
+    {
+        ::close(sockfd);
+    }
+
+    // Assembles the next frame from the chunks. A frame is delivered once
+    // all its chunks arrived, when a chunk of a newer frame shows up, or
+    // after UDP_TIMEOUT_MS, whichever comes first. Chunks of older frames,
+    // including ones that arrive after their frame was delivered, are
+    // dropped.
+    bool receive(const FrameDecoder &decoder, pointCloudXYZRGB &cloud) override
+    {
+        timePoint read_start = clockTime::now();
+        bool active = false;
+
+        if (has_pending)
+        {
+            const udpChunkHeader *hdr = (const udpChunkHeader *)pending.data();
+            startFrame(hdr);
+            addChunk(hdr);
+            has_pending = false;
+            active = true;
+        }
+
+        while (!active || received < num_chunks)
+        {
+            if (closed)
+                fail("Receive failure at " + stream_name);
+
+            int timeout = -1;
+            if (active)
+            {
+                double elapsed = timeMilli(clockTime::now() - start).count();
+                timeout = std::max(0, UDP_TIMEOUT_MS - int(elapsed));
+            }
+
+            struct pollfd pfd = {sockfd, POLLIN, 0};
+            int ready = poll(&pfd, 1, timeout);
+            if (ready < 0 && errno == EINTR)
+                continue;
+            if (ready == 0)
+                break;      // Timed out, deliver what arrived
+
+            ssize_t n = recv(sockfd, pending.data(), pending.size(), 0);
+            if (n < (ssize_t)sizeof(udpChunkHeader))
+                continue;
+
+            const udpChunkHeader *hdr = (const udpChunkHeader *)pending.data();
+            if (hdr->magic != UDP_MAGIC ||
+                n != (ssize_t)(sizeof(udpChunkHeader) + hdr->num_points * UDP_POINT_SHORTS * sizeof(short)))
+                continue;
+
+            if (!active)
+            {
+                // A late chunk must not start its delivered frame over
+                int32_t since = int32_t(hdr->frame_id - last_delivered);
+                if (delivered && since <= 0 && since >= -1000)
+                    continue;
+                startFrame(hdr);
+                active = true;
+            }
+
+            int32_t age = int32_t(hdr->frame_id - frame_id);
+            if (age > 0 || age < -1000)
+            {
+                // Newer frame (or the edge restarted): keep the chunk for next time
+                has_pending = true;
+                break;
+            }
+            if (age < 0)
+                continue;   // Late chunk of a frame already delivered
+
+            addChunk(hdr);
+        }
+
+        last_delivered = frame_id;
+        delivered = true;
+        stats.frames++;
+        if (received < num_chunks)
+        {
+            stats.partial_frames++;
+            stats.lost_chunks += num_chunks - received;
+        }
+
+        timePoint decode_start = clockTime::now();
+        decoder.decode(buffer, points, cloud);
+        stats.receive_ms = timeMilli(decode_start - read_start).count();
+        stats.decode_ms = timeMilli(clockTime::now() - decode_start).count();
+        return true;
+    }
+
+private:
+    // Starts assembling the frame the chunk belongs to.
+    void startFrame(const udpChunkHeader *hdr)
+    {
+        frame_id = hdr->frame_id;
+        stats.quality = hdr->quality;
+        num_chunks = hdr->num_chunks;
+        received = 0;
+        points = 0;
+        seen.assign(hdr->num_chunks, false);
+        start = clockTime::now();
+    }
+
+    // Copies a chunk's points to the end of the frame being assembled. Chunks
+    // carry whole points, so arrival order does not matter and missing chunks
+    // simply leave their points out.
+    void addChunk(const udpChunkHeader *hdr)
+    {
+        if (hdr->chunk_index >= seen.size() || seen[hdr->chunk_index])
+            return;
+        if (points + hdr->num_points > capacity)
+            return;
+
+        seen[hdr->chunk_index] = true;
+        received++;
+        memcpy(&buffer[points * UDP_POINT_SHORTS], hdr + 1, hdr->num_points * UDP_POINT_SHORTS * sizeof(short));
+        points += hdr->num_points;
+    }
+
+    std::vector<char> pending = std::vector<char>(65536);  // Last datagram read
+    bool has_pending = false;   // pending holds the first chunk of the next frame
+    uint32_t frame_id = 0;
+    uint32_t last_delivered = 0;    // Frame id of the last frame returned
+    bool delivered = false;
+    int num_chunks = 0;
+    int received = 0;
+    int points = 0;
+    std::vector<bool> seen;
+    timePoint start;
+};
+
+// Shared-memory ring of a co-located edge server. Frames are decoded in
+// place; if the edge server overwrote the slot while it was being read the
+// frame is dropped and the next one is used.
+class shmStream : public CameraStream
+{
+public:
+    explicit shmStream(const std::string &name)
+    {
+        stream_name = name;
+        std::cout << "Waiting for shared memory " << name << "..." << std::endl;
+        while (!shmAttach(&handle, name.c_str()))
+            usleep(100000);
+        std::cout << "Attached to " << name << std::endl;
+    }
+
+    ~shmStream()
+    {
+        shmClose(&handle);
+    }
+
+    bool receive(const FrameDecoder &decoder, pointCloudXYZRGB &cloud) override
+    {
+        const uint32_t max_points = handle.ring->slot_bytes / (5 * sizeof(short));
+        timePoint read_start = clockTime::now();
+
+        while (!closed)
+        {
+            uint32_t seq;
+            shmSlot *slot = shmWaitFrame(&handle, 1000, &seq);
+            if (!slot)
+            {
+                std::cerr << "No frames on " << stream_name << std::endl;
+                continue;
+            }
+
+            timePoint decode_start = clockTime::now();
+            decoder.decode(shmSlotData(slot), std::min(slot->num_points, max_points), cloud);
+            if (!shmValidate(slot, seq))
+            {
+                stats.dropped++;
+                continue;
+            }
+
+            stats.quality = slot->quality;
+            stats.receive_ms = timeMilli(decode_start - read_start).count();
+            stats.decode_ms = timeMilli(clockTime::now() - decode_start).count();
+            stats.frames++;
+            return true;
+        }
+
+        fail("Receive failure at " + stream_name);
+        return false;
+    }
+
+    void close() override
+    {
+        closed = true;
+    }
+
+private:
+    shmHandle handle = {};
+};
+
+std::unique_ptr<CameraStream> CameraStream::connect(const std::string &ip, int port, const StreamOptions &options)
+{
+    std::shared_ptr<tcpConnection> connection(new tcpConnection(ip, port));
+    if (connection->header.cameras != 1)
+        fail(connection->name + " streams " + std::to_string(connection->header.cameras) +
+             " cameras, connect to it with connectAll");
+    return std::unique_ptr<CameraStream>(new tcpStream(connection, 0, options));
+}
+
+std::vector<std::unique_ptr<CameraStream>> CameraStream::connectAll(const std::string &ip, int port,
+                                                                    const StreamOptions &options)
+{
+    std::shared_ptr<tcpConnection> connection(new tcpConnection(ip, port));
+    std::vector<std::unique_ptr<CameraStream>> streams;
+    for (int i = 0; i < connection->header.cameras; i++)
+        streams.emplace_back(new tcpStream(connection, i, options));
+    return streams;
+}
+
+std::unique_ptr<CameraStream> CameraStream::listen(int port, const std::string &group, const StreamOptions &options)
+{
+    return std::unique_ptr<CameraStream>(new udpStream(port, group, options));
+}
+
+std::unique_ptr<CameraStream> CameraStream::attach(const std::string &name)
+{
+    return std::unique_ptr<CameraStream>(new shmStream(name));
+}
+
+PlySink::PlySink(const std::string &prefix, int max_frames)
+    : prefix(prefix), max_frames(max_frames)
+{
+}
+
+void PlySink::consume(const StitchedFrame &frame)
+{
+    if (max_frames && saved >= max_frames)
+        return;
+
+    std::string filename(prefix + std::to_string(saved) + ".ply");
+    if (pcl::io::savePLYFileBinary(filename, *frame.cloud) < 0)
+        std::cerr << "Couldn't save " << filename << std::endl;
+    else
+        std::cout << "Saved frame " << saved << std::endl;
+    saved++;
+}
+
+Stitcher::Stitcher(const StitcherOptions &options)
+    : options(options), decoder(options.downsample, options.decode_threads)
+{
+}
+
+Stitcher::~Stitcher()
+{
+    if (push_thread.joinable())
+    {
+        pushing = false;
+        close();
+        push_thread.join();
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        quitting = true;
+    }
+    frame_start.notify_all();
+    close();
+
+    for (auto &slot : cameras)
+    {
+        if (slot->thread.joinable())
+            slot->thread.join();
+    }
+}
+
+int Stitcher::addCamera(std::unique_ptr<CameraStream> stream, const Eigen::Matrix4f &transform)
+{
+    if (frame_count)
+        fail("Cameras have to be added before the first frame");
+
+    cameras.emplace_back(new cameraSlot);
+    cameras.back()->stream = std::move(stream);
+    setTransform(cameras.size() - 1, transform);
+    return cameras.size() - 1;
+}
+
+// Readers never see a half-written matrix; the transform is swapped as a
+// whole.
+Eigen::Matrix4f Stitcher::transform(int index) const
+{
+    return *std::atomic_load(&cameras[index]->transform);
+}
+
+void Stitcher::setTransform(int index, const Eigen::Matrix4f &transform)
+{
+    std::shared_ptr<const Eigen::Matrix4f> next =
+        std::allocate_shared<Eigen::Matrix4f>(Eigen::aligned_allocator<Eigen::Matrix4f>(), transform);
+    std::atomic_store(&cameras[index]->transform, next);
+}
+
+void Stitcher::addSink(std::shared_ptr<Sink> sink)
+{
+    sinks.push_back(sink);
+}
+
+void Stitcher::close()
+{
+    for (auto &slot : cameras)
+        slot->stream->close();
+}
+
+// Receives, decodes and transforms one camera's cloud of the frame.
+void Stitcher::receiveCamera(int index)
+{
+    cameraSlot &slot = *cameras[index];
+    CameraStream &stream = *slot.stream;
+
+    pageFaults before = threadPageFaults();
+    if (stream.receive(decoder, *slot.target))
+    {
+        timePoint transform_start = clockTime::now();
+        pcl::transformPointCloud(*slot.target, *slot.target, slot.frame_transform);
+        stream.stats.decode_ms += timeMilli(clockTime::now() - transform_start).count();
+    }
+    pageFaults after = threadPageFaults();
+
+    stream.stats.minor_faults = after.minor - before.minor;
+    stream.stats.major_faults = after.major - before.major;
+    stream.stats.total_faults += stream.stats.minor_faults + stream.stats.major_faults;
+
+    if (options.camera_done)
+        options.camera_done(index, *slot.target);
+}
+
+// Camera thread body: one receive per frame generation.
+void Stitcher::cameraLoop(int index)
+{
+    if (options.thread_start)
+        options.thread_start(index);
+
+    uint64_t seen = 0;
+    while (1)
+    {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            frame_start.wait(lock, [&] { return quitting || generation != seen; });
+            if (quitting)
+                return;
+            seen = generation;
+        }
+
+        std::exception_ptr failure;
+        try
+        {
+            receiveCamera(index);
+        }
+        catch (...)
+        {
+            failure = std::current_exception();
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (failure && !error)
+            error = failure;
+        if (--pending == 0)
+            frame_done.notify_all();
+    }
+}
+
+void Stitcher::startCameraThreads()
+{
+    for (size_t i = 0; i < cameras.size(); i++)
+        cameras[i]->thread = std::thread(&Stitcher::cameraLoop, this, i);
+}
+
+void Stitcher::next(StitchedFrame &frame)
+{
+    const int n = cameras.size();
+    timePoint stitch_start = clockTime::now();
+
+    if (!frame_count && options.camera_threads)
+        startCameraThreads();
+
+    // Reuse the frame's clouds unless the caller kept a pointer to one
+    frame.cameras.resize(n);
+    for (auto &cloud : frame.cameras)
+    {
+        if (!cloud || cloud.use_count() > 1)
+            cloud = pointCloudXYZRGB::Ptr(new pointCloudXYZRGB);
+    }
+    if (!frame.cloud || frame.cloud.use_count() > 1)
+        frame.cloud = pointCloudXYZRGB::Ptr(new pointCloudXYZRGB(options.accumulate && frame.cloud ? *frame.cloud : pointCloudXYZRGB()));
+
+    frame.transforms.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        cameras[i]->target = frame.cameras[i].get();
+        cameras[i]->frame_transform = frame.transforms[i] = transform(i);
+    }
+
+    if (options.camera_threads)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        pending = n;
+        generation++;
+        frame_start.notify_all();
+        frame_done.wait(lock, [&] { return pending == 0; });
+        if (error)
+            std::rethrow_exception(error);
+    }
+    else
+    {
+        for (int i = 0; i < n; i++)
+            receiveCamera(i);
+    }
+
+    if (!options.accumulate)
+        frame.cloud->clear();
+
+    frame.camera_offsets.resize(n);
+    for (int i = 0; i < n; i++)
+    {
+        frame.camera_offsets[i] = frame.cloud->size();
+        if (options.merge)
+            *frame.cloud += *frame.cameras[i];
+    }
+
+    frame.frame_id = frame_count++;
+
+    if (options.process)
+        options.process(frame);
+
+    frame.stitch_ms = timeMilli(clockTime::now() - stitch_start).count();
+
+    for (auto &sink : sinks)
+        sink->consume(frame);
+}
+
+void Stitcher::start(std::function<void(const StitchedFrame &)> callback)
+{
+    pushing = true;
+    push_thread = std::thread([this, callback] {
+        StitchedFrame frame;
+        try
+        {
+            while (pushing)
+            {
+                next(frame);
+                if (callback)
+                    callback(frame);
+            }
+        }
+        catch (...)
+        {
+            if (pushing)
+                push_error = std::current_exception();
+        }
+    });
+}
+
+void Stitcher::stop()
+{
+    pushing = false;
+    if (push_thread.joinable())
+        push_thread.join();
+    if (push_error)
+        std::rethrow_exception(push_error);
+}
+
+}
@@ -0,0 +1,250 @@
+/*
+ * pcs-stitch.h
+ *
+ * Stitching library (libpcs). pcs-multicamera-optimized is built on it, and
+ * any other process can link it to receive and stitch the edge streams
+ * without going through a separate binary.
+ *
+ *   CameraStream   one edge stream, over TCP, UDP or shared memory
+ *   FrameDecoder   turns the packed points of a frame into a cloud
+ *   Stitcher       receives every camera, transforms and merges the clouds
+ *   Sink           consumer of stitched frames
+ *
+ * Frames are pulled with Stitcher::next(), or delivered from a background
+ * thread to a callback with Stitcher::start(). Either way they are handed
+ * to every sink first. Failures are thrown as std::runtime_error.
+ */
+
+#ifndef PCS_STITCH_H
+#define PCS_STITCH_H
+
+#include <stdint.h>
+
+#include <atomic>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/StdVector>
+#include <pcl/point_cloud.h>
+#include <pcl/point_types.h>
+
+namespace pcs {
+
+typedef pcl::PointCloud<pcl::PointXYZRGB> pointCloudXYZRGB;
+
+const int UDP_DEFAULT_MAX_POINTS = 1280 * 720;    // Largest depth profile; UDP has no handshake
+
+struct StreamOptions
+{
+    int numa_node = -1;         // Node of the receive buffer, -1 for the default placement
+    bool lock_memory = false;   // Lock the receive buffer in RAM
+    int max_points = UDP_DEFAULT_MAX_POINTS;  // Capacity of UDP streams
+    bool background = true;     // Merge the last background refresh into foreground-only TCP frames
+};
+
+struct CameraStats
+{
+    long frames = 0;            // Frames received
+    long dropped = 0;           // Oversized (TCP) or torn (shared memory) frames
+    long partial_frames = 0;    // UDP frames delivered with chunks missing
+    long lost_chunks = 0;
+    long background_frames = 0; // Background refreshes received
+    int quality = 0;            // Adaptive quality level of the last frame
+    double receive_ms = 0;      // Last frame, waiting for and reading the data
+    double decode_ms = 0;       // Last frame, decoding and transforming
+    long minor_faults = 0;      // Last frame, while receiving and decoding
+    long major_faults = 0;
+    long total_faults = 0;
+};
+
+// Converts frames of packed points (x, y, z in millimeters, rg, b) into
+// clouds, keeping every downsample-th point. The cloud is reused from frame
+// to frame, so its points keep their allocation.
+class FrameDecoder
+{
+public:
+    explicit FrameDecoder(int downsample = 1, int threads = 1);
+
+    // Decodes the points of buffer, followed by those of extra if given.
+    void decode(const short *buffer, int points, pointCloudXYZRGB &cloud,
+                const short *extra = nullptr, int extra_points = 0) const;
+
+private:
+    int downsample;
+    int threads;                // OpenMP threads per frame
+};
+
+class CameraStream
+{
+public:
+    virtual ~CameraStream() {}
+
+    // Connects to an edge server and reads its stream handshake, which sizes
+    // the receive buffer. Fails if the server streams several cameras.
+    static std::unique_ptr<CameraStream> connect(const std::string &ip, int port,
+                                                 const StreamOptions &options = StreamOptions());
+
+    // Connects to an edge server that drives several cameras, returning one
+    // stream per camera in camera order. The streams share the connection
+    // and are meant to be added to the same Stitcher.
+    static std::vector<std::unique_ptr<CameraStream>> connectAll(const std::string &ip, int port,
+                                                                 const StreamOptions &options = StreamOptions());
+
+    // Listens for an edge server's UDP chunks, joining the group if it is a
+    // multicast address.
+    static std::unique_ptr<CameraStream> listen(int port, const std::string &group,
+                                                const StreamOptions &options = StreamOptions());
+
+    // Maps the shared-memory ring of a co-located edge server, waiting for
+    // it to be created.
+    static std::unique_ptr<CameraStream> attach(const std::string &name);
+
+    // Receives the next frame into the cloud. Returns false if the frame was
+    // dropped, leaving the cloud as it was.
+    virtual bool receive(const FrameDecoder &decoder, pointCloudXYZRGB &cloud) = 0;
+
+    // Makes a blocked or later receive() throw. Called from another thread.
+    virtual void close() = 0;
+
+    const std::string &name() const { return stream_name; }
+
+    CameraStats stats;
+
+protected:
+    std::string stream_name;
+    std::atomic<bool> closed{false};
+};
+
+// One stitched frame. The clouds are owned by the frame: passing the same
+// frame to Stitcher::next() again reuses them, unless a pointer to one was
+// kept, in which case a fresh cloud replaces it.
+struct StitchedFrame
+{
+    uint64_t frame_id = 0;
+    pointCloudXYZRGB::Ptr cloud;                    // All cameras, in the global frame
+    std::vector<pointCloudXYZRGB::Ptr> cameras;     // Each camera's transformed cloud
+    std::vector<size_t> camera_offsets;             // First point of each camera in cloud
+    std::vector<Eigen::Matrix4f, Eigen::aligned_allocator<Eigen::Matrix4f>> transforms;  // Used for this frame
+    double stitch_ms = 0;
+};
+
+class Sink
+{
+public:
+    virtual ~Sink() {}
+    virtual void consume(const StitchedFrame &frame) = 0;
+};
+
+// Saves frames as binary PLY files named <prefix><n>.ply, up to max_frames
+// of them (0 for no limit).
+class PlySink : public Sink
+{
+public:
+    explicit PlySink(const std::string &prefix, int max_frames = 0);
+    void consume(const StitchedFrame &frame) override;
+
+private:
+    std::string prefix;
+    int max_frames;
+    int saved = 0;
+};
+
+struct StitcherOptions
+{
+    // Threading: each camera is received on its own thread, or in turn on
+    // the caller's thread. Decoding a frame may use several OpenMP threads.
+    bool camera_threads = true;
+    int decode_threads = 1;
+
+    int downsample = 1;
+    bool merge = true;          // Concatenate the camera clouds into the frame's cloud
+    bool accumulate = false;    // Keep the points of earlier frames in the frame's cloud
+
+    // Called on each camera thread when it starts, e.g. to pin it
+    std::function<void(int camera)> thread_start;
+    // Called on the camera's thread once its cloud of the frame is ready
+    std::function<void(int camera, const pointCloudXYZRGB &cloud)> camera_done;
+    // Called once the frame is merged, before the sinks
+    std::function<void(StitchedFrame &frame)> process;
+};
+
+class Stitcher
+{
+public:
+    explicit Stitcher(const StitcherOptions &options = StitcherOptions());
+    ~Stitcher();
+
+    Stitcher(const Stitcher &) = delete;
+    Stitcher &operator=(const Stitcher &) = delete;
+
+    // Adds a camera and returns its index. Cameras are added before the
+    // first frame.
+    int addCamera(std::unique_ptr<CameraStream> stream, const Eigen::Matrix4f &transform);
+    int numCameras() const { return (int)cameras.size(); }
+    CameraStream &camera(int index) { return *cameras[index]->stream; }
+
+    // The camera's transform into the global frame. It may be replaced while
+    // frames are being stitched; each frame uses one consistent set.
+    Eigen::Matrix4f transform(int index) const;
+    void setTransform(int index, const Eigen::Matrix4f &transform);
+
+    void addSink(std::shared_ptr<Sink> sink);
+
+    // Pull API: receives and stitches the next frame into the given one.
+    void next(StitchedFrame &frame);
+
+    // Push API: stitches frames on a background thread until stop(), handing
+    // each to the sinks and then the callback. stop() returns once the frame
+    // in progress is done, and rethrows an error that ended the thread.
+    void start(std::function<void(const StitchedFrame &)> callback = nullptr);
+    void stop();
+
+    // Closes every camera stream, so pending receives fail.
+    void close();
+
+private:
+    struct cameraSlot
+    {
+        std::unique_ptr<CameraStream> stream;
+        std::shared_ptr<const Eigen::Matrix4f> transform;
+        std::thread thread;
+        pointCloudXYZRGB *target = nullptr;
+        Eigen::Matrix4f frame_transform;
+
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    void receiveCamera(int index);
+    void cameraLoop(int index);
+    void startCameraThreads();
+
+    StitcherOptions options;
+    FrameDecoder decoder;
+    std::vector<std::unique_ptr<cameraSlot>> cameras;
+    std::vector<std::shared_ptr<Sink>> sinks;
+    uint64_t frame_count = 0;
+
+    // Camera threads run one frame per generation
+    std::mutex mutex;
+    std::condition_variable frame_start;
+    std::condition_variable frame_done;
+    uint64_t generation = 0;
+    int pending = 0;
+    bool quitting = false;
+    std::exception_ptr error;
+
+    std::thread push_thread;
+    std::atomic<bool> pushing{false};
+    std::exception_ptr push_error;
+};
+
+}
+
+#endif
@@ -0,0 +1,40 @@
+/*
+ * pcs-udp.h
+ *
+ * Wire format of the UDP point transport shared by the edge servers and
+ * the central computer. A frame is split into datagrams that each carry
+ * whole points, so every chunk can be decoded on its own and a lost chunk
+ * only costs the points inside it.
+ */
+
+#ifndef PCS_UDP_H
+#define PCS_UDP_H
+
+#include <stdint.h>
+
+#define UDP_MAGIC           0x50435355  // "PCSU"
+#define UDP_MTU             1500
+#define UDP_MIN_MTU         576         // Smallest datagram every IPv4 host must accept
+#define UDP_MAX_MTU         65535       // Largest IPv4 datagram
+#define UDP_IP_OVERHEAD     28          // IPv4 + UDP headers
+#define UDP_TIMEOUT_MS      50          // Deliver a partial frame after this long
+#define UDP_POINT_SHORTS    5           // x, y, z, rg, b
+
+struct __attribute__((packed)) udpChunkHeader {
+    uint32_t magic;
+    uint32_t frame_id;
+    uint32_t point_offset;      // Index of the first point of this chunk in the frame
+    uint32_t frame_points;      // Total points in the frame
+    uint16_t chunk_index;
+    uint16_t num_chunks;
+    uint16_t num_points;        // Points carried by this chunk
+    uint8_t quality;            // Adaptive quality level of the frame
+    uint8_t reserved;
+};
+
+// Number of whole points that fit in one datagram for the given MTU.
+inline int udpPointsPerChunk(int mtu) {
+    return (mtu - UDP_IP_OVERHEAD - int(sizeof(udpChunkHeader))) / (UDP_POINT_SHORTS * int(sizeof(short)));
+}
+
+#endif